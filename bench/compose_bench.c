@@ -0,0 +1,92 @@
+#include <compose.h>
+#include <palette.h>
+#include <ppu.h>
+#include <string.h>
+#include <time.h>
+
+// Compares every supported compositor kernel against the scalar one and
+// times a full 160 pixel line as well as the FIFO's 8 pixel fetches.
+
+#define ITERATIONS 200000
+#define LINE_ROWS 20
+#define LINE_PIXELS (LINE_ROWS * 8)
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u8 planes[LINE_ROWS * 2];
+static u8 overlay[LINE_PIXELS];
+static u8 map[16];
+
+static void fill_inputs() {
+    srand(1234);
+    for (int i=0; i<LINE_ROWS * 2; ++i) {
+        planes[i] = rand();
+    }
+    for (int i=0; i<LINE_PIXELS; ++i) {
+        u8 v = rand();
+        overlay[i] = (v & 3) ? (v & (OVERLAY_COLOUR | OVERLAY_PN | OVERLAY_BGP)) : 0;
+    }
+    for (int pal=PAL_BG; pal<=PAL_OBP1; ++pal) {
+        for (int c=0; c<4; ++c) {
+            map[c | (pal << 2)] = PIXEL_PACK(3 - c, pal);
+        }
+    }
+}
+
+static void run_line(u8* out) {
+    u8 bg[LINE_PIXELS];
+    compose_decode(planes, LINE_ROWS, bg);
+    compose_merge(bg, overlay, map, out, LINE_PIXELS);
+}
+
+static void run_fetches(u8* out) {
+    u8 bg[8];
+    for (int r=0; r<LINE_ROWS; ++r) {
+        compose_decode(planes + r * 2, 1, bg);
+        compose_merge(bg, overlay + r * 8, map, out + r * 8, 8);
+    }
+}
+
+static double bench(void (*fn)(u8*), u8* out) {
+    u64 start = now_ns();
+    for (int i=0; i<ITERATIONS; ++i) {
+        fn(out);
+        __asm__ __volatile__("" : : "r"(out) : "memory");
+    }
+    return (double)(now_ns() - start) / ITERATIONS;
+}
+
+int main() {
+    fill_inputs();
+
+    u8 expected[LINE_PIXELS];
+    compose_select(COMPOSE_SCALAR);
+    run_line(expected);
+    double scalar_line = bench(run_line, expected);
+    double scalar_fetch = bench(run_fetches, expected);
+
+    int failures = 0;
+    for (int impl=COMPOSE_SCALAR; impl<=COMPOSE_NEON; ++impl) {
+        if (!compose_select(impl)) {
+            continue;
+        }
+
+        u8 line[LINE_PIXELS];
+        u8 fetches[LINE_PIXELS];
+        run_line(line);
+        run_fetches(fetches);
+        bool ok = !memcmp(line, expected, sizeof(line)) && !memcmp(fetches, expected, sizeof(fetches));
+        failures += !ok;
+
+        double line_ns = bench(run_line, line);
+        double fetch_ns = bench(run_fetches, fetches);
+        printf("%-6s line %7.1f ns (%4.2fx)  fetches %7.1f ns (%4.2fx)  %s\n",
+            compose_name(impl), line_ns, scalar_line / line_ns,
+            fetch_ns, scalar_fetch / fetch_ns, ok ? "ok" : "MISMATCH");
+    }
+    return failures ? 1 : 0;
+}
@@ -1,18 +1,167 @@
 #pragma once
 #include <common.h>
+#include <blip.h>
 
 // DMG APU clock: 4,194,304 Hz (same ticks you already step for PPU/TIMER)
 #define APU_CLOCK_HZ 4194304
 
+// One copy of the sound hardware. A synthesising copy runs the channel
+// timers and mixes into its step buffers; otherwise only what the CPU can
+// see is kept: registers, the frame sequencer and trigger handling.
+typedef struct {
+    bool synth;
+
+    // Common APU power & mixer
+    bool power;
+    u8 nr50, nr51, nr52;
+
+    // Frame Sequencer
+    u64 fs_next;         // emu tick of the next step
+    u8  fs_step;         // 0..7
+
+    // Band-limited synthesis
+    u64 ticks;           // emu tick the channels have been run up to
+    u64 frame_start;     // emu tick of clock 0 in the step buffers
+    blip_buffer blip_l, blip_r;
+    u8  level[4];        // current channel outputs, 0..15
+    int out_l[4], out_r[4]; // what each channel adds to each side
+
+    // Channel 1: Square + sweep
+    struct {
+        bool enabled;
+        u8 duty;              // 0..3
+        u16 freq;             // 11-bit
+        u16 timer;            // down-counter
+        u8  duty_pos;         // 0..7
+        u8  length;           // 0..63 (64 steps)
+        bool length_enable;
+
+        // Envelope
+        u8  env_period;       // 0..7 (0 => special means no ticks)
+        u8  env_vol;          // 0..15 current volume
+        bool env_increase;    // true=up, false=down
+        u8  env_counter;      // countdown
+
+        // Sweep
+        u8  sweep_period;     // 0..7
+        bool sweep_negate;
+        u8  sweep_shift;      // 0..7
+        u8  sweep_counter;    // countdown
+        bool sweep_enabled;   // as HW
+
+        // Trigger latch of NRx2 initial volume (for retrigger)
+        u8  init_volume;
+    } ch1;
+
+    // Channel 2: Square (no sweep)
+    struct {
+        bool enabled;
+        u8 duty;
+        u16 freq;
+        u16 timer;
+        u8 duty_pos;
+        u8 length;
+        bool length_enable;
+
+        u8  env_period;
+        u8  env_vol;
+        bool env_increase;
+        u8  env_counter;
+
+        u8  init_volume;
+    } ch2;
+
+    // Channel 3: Wave (stubbed: always zero output)
+    struct {
+        bool enabled;       // NR30 bit7
+        bool dac_on;        // NR30 bit7 (same)
+        u8  length;         // 0..255
+        bool length_enable; // NR34 bit6
+        u16 freq;
+        u16 timer;
+        u8  pos;            // 0..31
+        u8  level;          // NR32 (00:mute, 01:100%, 10:50%, 11:25%)
+        u8  wave_ram[16];   // 32 samples (4-bit) – two per byte
+    } ch3;
+
+    // Channel 4: Noise
+    struct {
+        bool enabled;
+        u8 length;           // 0..63 (64 steps)
+        bool length_enable;
+
+        u8  env_period;
+        u8  env_vol;
+        bool env_increase;
+        u8  env_counter;
+
+        u16 lfsr;            // 15-bit LFSR
+        u8  clock_shift;     // NR43 bits6..4
+        u8  width_mode7;     // NR43 bit3 (1=7-bit)
+        u8  divisor_code;    // NR43 bits2..0 (0=>8)
+        u16 timer;           // noise timer
+    } ch4;
+} apu_state;
+
 // Call once at startup. sample_rate example: 48000 or 44100
 void apu_init(int sample_rate);
 
+// Output rate to use instead of the one apu_init is called with, and the
+// band-limiting kernel length (BLIP_MEDIUM by default). Set before
+// apu_init.
+void apu_set_sample_rate(int hz);
+void apu_set_quality(blip_quality quality);
+
+// Also write the output to a WAV file, see wav_capture.h. Works without
+// an audio device and with apu_set_muted. Set before apu_init.
+void apu_set_capture(const char* path);
+
+// Audio latency the rate control aims for, default 40 ms. Can be set
+// before apu_init.
+void apu_set_latency(int ms);
+
+// Synthesise on a separate audio thread, see apu_thread.h. Set before
+// apu_init.
+void apu_set_threaded(bool on);
+
+// No audio output. Registers, the frame sequencer (length, sweep and
+// envelope) and triggers still run, so NR52 and length expiry read back
+// as usual; channel timers, mixing and resampling are skipped. Set before
+// apu_init.
+void apu_set_muted(bool on);
+bool apu_playing(void);
+double apu_queued_ms(void);
+double apu_target_ms(void);
+
+// Output queue health, readable from any thread.
+typedef struct {
+    u64 underruns;      // callbacks that ran out of queued audio
+    u64 overruns;       // blocks that did not fit in the queue
+    u64 dropped_frames; // stereo frames those blocks lost
+    u32 queued_frames;  // fill level now
+    u32 capacity_frames;
+} apu_stats;
+
+void apu_get_stats(apu_stats* stats);
+
+// The copy the CPU talks to, for save states. Loading one keeps the
+// session's synth flag and step buffers; apu_state_loaded then brings the
+// audio thread's copy and the scheduled flush in line.
+apu_state* apu_get_state(void);
+void apu_state_loaded(void);
+
 // Power-on / reset (also called from emu_run)
 void apu_reset(void);
 
-// Tick the APU by one T-cycle (you already call timer_tick()/ppu_tick() per dot)
-void apu_tick(void);
+// Starts the scheduled output flush at emu tick ticks. The channels are
+// otherwise only run when their registers are accessed.
+void apu_start(u64 ticks);
+void apu_stop(void);
 
 // Map I/O
 u8  apu_io_read(u16 addr);
 void apu_io_write(u16 addr, u8 v);
+
+// Replay of queued writes on the audio thread.
+void apu_synth_write(u64 ticks, u16 addr, u8 v);
+void apu_synth_flush(u64 ticks);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <common.h>
+#include <spsc.h>
+
+// Audio thread for --audio-thread. The emulation thread queues every APU
+// register write with its tick, plus a sync record each flush period; the
+// audio thread replays them into its own copy of the APU and synthesises
+// up to each sync. Register reads never leave the emulation thread.
+
+typedef enum {
+    AQ_WRITE,
+    AQ_SYNC
+} apu_op;
+
+typedef struct {
+    apu_op op;
+    u64 ticks; // emu tick the record was queued on, or synthesise up to
+    u16 address;
+    u8 value;
+} apu_record;
+
+#define APU_QUEUE_SIZE 4096 // records, power of two
+
+// Single producer (emulation thread), single consumer (audio thread).
+typedef struct {
+    apu_record records[APU_QUEUE_SIZE];
+    u32 head __attribute__((aligned(64))); // next slot to write, producer owned
+    u32 tail __attribute__((aligned(64))); // next slot to read, consumer owned
+
+    worker thread; // woken on sync records and when full
+} apu_thread_context;
+
+apu_thread_context* apu_thread_get_context();
+void apu_thread_start();
+void apu_thread_stop();
+
+void apu_queue_write(u16 address, u8 value);
+void apu_queue_sync(u64 ticks);
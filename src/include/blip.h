@@ -0,0 +1,55 @@
+#pragma once
+
+#include <common.h>
+
+// Band-limited step buffer. Amplitude changes are added as deltas at
+// clock times; each delta is spread over the kernel's taps with a
+// band-limited impulse (a polyphase windowed sinc), and reading
+// integrates the buffer back into a waveform. Sources only pay for the
+// times their output changes, and any output rate works.
+
+#define BLIP_MAX_PHASES 256 // sub-sample positions tabulated at the highest quality
+#define BLIP_MAX_TAPS 32    // output samples a delta touches at the highest quality
+#define BLIP_SIZE 4096      // output samples the buffer can hold between reads
+#define BLIP_KERNEL_BITS 15
+
+// Longer kernels cut closer to Nyquist, more phases place deltas more
+// precisely; both lower aliasing. Costs are work per delta, latency
+// (taps / 2 samples) and table size.
+typedef enum {
+    BLIP_LOW,    // 8 taps, 32 phases
+    BLIP_MEDIUM, // 16 taps, 64 phases
+    BLIP_HIGH    // 32 taps, 256 phases
+} blip_quality;
+
+typedef struct {
+    u64 factor;   // output samples per clock, 32.32 fixed point
+    u64 offset;   // position of clock 0 of the current frame, 32.32
+    int32_t integrator;
+    int32_t buf[BLIP_SIZE + BLIP_MAX_TAPS];
+} blip_buffer;
+
+// Builds the kernel for every buffer and picks the widest delta kernel
+// the CPU supports. Called by the first blip_init if not before.
+void blip_set_quality(blip_quality quality);
+const char* blip_impl_name();
+
+void blip_init(blip_buffer* b, double samples_per_clock);
+void blip_set_rate(blip_buffer* b, double samples_per_clock);
+
+// delta must fit in 16 bits.
+void blip_add_delta(blip_buffer* b, u32 clock, int delta);
+
+// Ends the current frame after the given clocks; its samples can be read.
+void blip_end_frame(blip_buffer* b, u32 clocks);
+int blip_samples_avail(const blip_buffer* b);
+
+// Reads up to count samples into out, spaced stride apart.
+int blip_read_samples(blip_buffer* b, int16_t* out, int count, int stride);
+
+// Entries of buf that deltas up to clocks into the current frame can have
+// touched; the rest are zero.
+int blip_used(const blip_buffer* b, u32 clocks);
+
+// Drops everything buffered, keeps the rate.
+void blip_clear(blip_buffer* b);
@@ -19,8 +19,38 @@ typedef struct {
     u16 global_checksum;
 } rom_header;
 
+typedef struct {
+    char filename[1024];
+    u32 rom_size;
+    u8 *rom_data;
+    rom_header *header;
+
+    //mbc1 related data
+    bool ram_enabled;
+    bool ram_banking;
+
+    u8 *rom_bank_x;
+    u8 banking_mode;
+
+    u8 rom_bank_value;
+    u8 ram_bank_value;
+
+    u8 *ram_bank; //current selected ram bank
+    u8 *ram_banks[16]; //all ram banks
+
+    //for battery
+    bool battery; //has battery
+    bool need_save; //should save battery backup.
+    const char* save_suffix; //added to the battery file name, for a second instance
+} cart_context;
+
+cart_context* cart_get_context();
+
 bool cart_load(char* cart);
 
+// Battery saves go to <rom><suffix>.battery, call before cart_load.
+void cart_set_save_suffix(const char* suffix);
+
 u8 cart_read(u16 address);
 void cart_write(u16 address, u8 value);
 
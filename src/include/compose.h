@@ -0,0 +1,25 @@
+#pragma once
+
+#include <common.h>
+
+// Scanline compositing kernels. compose_init() picks the widest
+// implementation the CPU supports, compose_select() forces one.
+typedef enum {
+    COMPOSE_SCALAR,
+    COMPOSE_SSE2,
+    COMPOSE_AVX2,
+    COMPOSE_NEON
+} compose_impl;
+
+void compose_init();
+bool compose_supported(compose_impl impl);
+bool compose_select(compose_impl impl);
+compose_impl compose_current();
+const char* compose_name(compose_impl impl);
+
+// Decode tile rows (lo, hi plane pairs) into 8 colour indices per row.
+void compose_decode(const u8* planes, int rows, u8* out);
+
+// Merge BG colour indices with a sprite overlay (may be NULL) and map
+// the result through map[colour | palette << 2] (see palette.h).
+void compose_merge(const u8* bg, const u8* overlay, const u8* map, u8* out, int count);
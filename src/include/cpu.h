@@ -27,6 +27,7 @@ typedef struct {
     u8 int_flags; 
 } cpu_context;
 
+cpu_context* cpu_get_context();
 cpu_registers* cpu_get_regs();
 
 void cpu_init();
@@ -3,5 +3,6 @@
 #include <common.h>
 #include <cpu.h>
 
-void dbg_update();
+// Bytes sent over serial with the internal clock, as test ROMs print.
+void dbg_serial(u8 c);
 void dbg_print();
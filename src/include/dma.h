@@ -9,6 +9,8 @@ typedef struct {
     u8 start_delay;
 } dma_context;
 
+dma_context* dma_get_context();
+
 void dma_start(u8 start);
 void dma_tick();
 
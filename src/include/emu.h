@@ -2,11 +2,24 @@
 
 #include <common.h>
 
+#define EMU_CLOCK_HZ 4194304 // dots per second
+
 typedef struct {
     bool paused;
     bool running;
     u64 ticks;
     bool die;
+
+    // Running a machine nobody watches (a rollback replay or the remote
+    // player): no pacing, frame publishing, sound output or battery saves.
+    // Headless machines also draw nothing.
+    bool shadow;
+    bool headless;
+
+    // Quick save and load asked for by the UI, done on the emulation
+    // thread between instructions.
+    bool save_state;
+    bool load_state;
 } emu_context;
 
 int emu_run(int argc, char** argv);
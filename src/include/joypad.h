@@ -13,10 +13,33 @@ typedef struct {
     bool right;
 } joypad_state;
 
+typedef struct {
+    bool button_sel;
+    bool dir_sel;
+    joypad_state controller; // what the machine sees when fed
+} joypad_context;
+
+// Buttons packed into a byte, as sent over the network.
+#define JOYPAD_A      (1 << 0)
+#define JOYPAD_B      (1 << 1)
+#define JOYPAD_SELECT (1 << 2)
+#define JOYPAD_START  (1 << 3)
+#define JOYPAD_RIGHT  (1 << 4)
+#define JOYPAD_LEFT   (1 << 5)
+#define JOYPAD_UP     (1 << 6)
+#define JOYPAD_DOWN   (1 << 7)
+
 void joypad_init();
 bool joypad_button_sel();
 bool joypad_dir_sel();
 void joypad_set_sel(u8 value);
 
+joypad_context* joypad_get_context();
+
+// The player's input, as the UI sets it.
 joypad_state* joypad_get_state();
+u8 joypad_buttons();
+
+// From now on the machine sees these buttons instead of the player's.
+void joypad_feed(u8 buttons);
 u8 joypad_get_output();
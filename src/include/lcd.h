@@ -15,9 +15,9 @@ typedef struct {
     u8 win_y;
     u8 win_x;
 
-    u32 bg_colours[4];
-    u32 sp1_colours[4];
-    u32 sp2_colours[4];
+    // Packed output pixel for each colour index | palette << 2,
+    // decoded from the palette registers.
+    u8 pixel_map[16];
 } lcd_context;
 
 typedef enum {
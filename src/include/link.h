@@ -0,0 +1,60 @@
+#pragma once
+
+#include <common.h>
+
+// Link cable between two emulator instances. link_fork() runs a second
+// instance in a child process; the two share one mailbox in shared memory
+// and only wait for each other at transfer boundaries:
+//  - each side publishes its tick count once per serial bit period
+//  - the internal clock side posts its byte at the end of its transfer
+//    and waits until the peer answers, or until the peer has run past
+//    that tick without arming, in which case it reads 0xFF
+//  - the external clock side polls once per bit while armed and answers
+//    with its SB at its first poll from the tick the peer's transfer
+//    ended on. While armed it never runs ahead of the peer's published
+//    tick, so both sides see the transfer end at the same time
+// Either side closing the link wakes a waiting peer. Waits also give up
+// when the peer process has died, even while holding the lock.
+//
+// link_pair() instead links two machines simulated in turns by this
+// process (see rollback.h). Nothing waits: the internal clock side takes
+// the byte the peer last armed with, and the peer sees its transfer end
+// at its first poll from that tick on.
+
+// Returns 0 in the parent, 1 in the child, -1 on failure. Call before any
+// thread is started.
+int link_fork();
+bool link_connected();
+void link_close();
+
+// In the parent, waits for the child instance to exit. Call on the way
+// out, after link_close.
+void link_join();
+
+// Pair mode. link_select picks the machine calls are made for; the link
+// state is part of what a rollback restores.
+typedef struct {
+    bool armed;
+    u8 sb;        // SB published while armed
+    bool has_in;
+    u8 in;
+    u64 in_ticks; // tick the peer's transfer ended on
+} link_pair_side;
+
+typedef struct {
+    link_pair_side side[2];
+} link_pair_state;
+
+void link_pair();
+void link_select(int side);
+link_pair_state* link_pair_get_state();
+
+// Publishes this side's tick count.
+void link_sync(u64 ticks);
+
+// Internal clock transfer ending at ticks, returns the byte shifted in.
+u8 link_transfer(u8 out, u64 ticks);
+
+// External clock side.
+void link_arm(bool armed, u8 sb);
+bool link_poll(u8 out, u8* in, u64 ticks);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <common.h>
+
+// Keeps emulation in step with real time. Deadlines are absolute: each
+// frame's target is derived from the emu tick count since the last
+// rebase, so rounding never accumulates. Waits sleep until shortly before
+// the deadline and spin the rest of the way.
+
+#define PACER_TURBO 0.0           // speed value for unlimited
+#define PACER_SPIN_NS 1000000     // spin for the last 1 ms
+#define PACER_REBASE_NS 100000000 // more than 100 ms behind: start over
+#define PACER_AUDIO_POLL_NS 500000  // audio queue check interval when audio paced
+
+typedef struct {
+    double speed;      // emulated seconds per real second, PACER_TURBO for unlimited
+    bool audio_sync;   // at 1x, pace on the audio queue instead of the clock
+    u64 base_ns;       // CLOCK_MONOTONIC time the deadlines are counted from
+    u64 base_ticks;    // emu ticks at base_ns
+
+    // Measured over the current report window.
+    u64 report_ns;
+    u32 frames;
+    int64_t drift_total_ns; // sum of how late each frame finished waiting
+    int64_t drift_max_ns;
+    u64 audio_underruns; // totals at the last report
+    u64 audio_overruns;
+} pacer_context;
+
+pacer_context* pacer_get_context();
+void pacer_init(u64 ticks);
+void pacer_set_speed(double speed);
+void pacer_set_audio_sync(bool on);
+
+// Waits for the frame ending at ticks; returns true once a second, after
+// printing the frame rate and drift, and any new audio glitches.
+bool pacer_frame(u64 ticks);
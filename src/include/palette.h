@@ -0,0 +1,28 @@
+#pragma once
+
+#include <common.h>
+
+// Indexed pixels hold a 2-bit shade plus the palette that produced it.
+typedef enum {
+    PAL_BG,
+    PAL_OBP0,
+    PAL_OBP1
+} palette_id;
+
+#define PALETTE_ENTRIES 12
+#define PIXEL_PACK(shade, pal) ((u8)((shade) | ((pal) << 2)))
+
+typedef enum {
+    PALETTE_GREY,
+    PALETTE_GREEN,
+    PALETTE_USER
+} palette_preset;
+
+void palette_select(palette_preset preset);
+void palette_set_user(const u32 colours[PALETTE_ENTRIES]);
+
+// ARGB colour for each packed pixel value.
+const u32* palette_colours();
+
+// Convert count indexed pixels to ARGB.
+void palette_convert(const u8* src, u32* dst, int count);
@@ -1,13 +1,14 @@
 #pragma once
 
 #include <common.h>
+#include <pthread.h>
+#include <stddef.h>
 
 static const int LINES_PER_FRAME = 154;
 static const int TICKS_PER_LINE = 456;
 static const int YRES = 144;
 static const int XRES = 160;
 
-#define TARGET_FPS 60
 
 typedef enum {
     FS_TILE,
@@ -19,7 +20,7 @@ typedef enum {
 
 typedef struct _fifo_entry {
     struct _fifo_entry* next;
-    u32 value; // 32 bit colour value
+    u8 value; // packed shade and palette, see palette.h
 } fifo_entry;
 
 typedef struct {
@@ -28,6 +29,13 @@ typedef struct {
     u32 size;
 } fifo;
 
+typedef enum {
+    RENDER_FIFO,     // pixel FIFO stepped every dot of mode 3
+    RENDER_SCANLINE, // whole line drawn when mode 3 starts
+    RENDER_THREAD,   // lines drawn on the render thread from queued state
+    RENDER_PARALLEL  // lines captured during the frame, drawn at VBlank on a worker pool
+} ppu_renderer;
+
 typedef struct {
     fetch_state cur_fetch_state;
     fifo pixel_fifo;
@@ -35,7 +43,6 @@ typedef struct {
     u8 pushed_x;
     u8 fetch_x;
     u8 bgw_fetch_data[3];
-    u8 fetch_entry_data[6];
     u8 map_y;
     u8 map_x;
     u8 tile_y;
@@ -54,35 +61,131 @@ typedef struct {
     unsigned f_bgp : 1;
 } oam_entry;
 
-typedef struct _oam_line_entry {
-    oam_entry entry;
-    struct _oam_line_entry* next;
-} oam_line_entry;
+#define SPRITE_LINES 144
+#define SPRITES_PER_LINE 10
+
+// Selected sprites for one line, sorted by x.
+typedef struct {
+    u8 count;
+    u8 x[SPRITES_PER_LINE];
+    u8 oam_index[SPRITES_PER_LINE];
+} sprite_line;
+
+// Register state a line is drawn with, captured when mode 3 starts.
+typedef struct {
+    u8 ly;
+    u8 lcdc;
+    u8 sc_x;
+    u8 sc_y;
+    u8 win_x;
+    u8 window_line;
+    bool window; // window drawn on this line
+    u8 pixel_map[16];
+    sprite_line sprites;
+} line_state;
+
+// sprite_overlay entry layout, attribute bits match the OAM flags.
+#define OVERLAY_COLOUR 0b11
+#define OVERLAY_PN (1 << 4)
+#define OVERLAY_BGP (1 << 7)
+#define OVERLAY_PAD 8
+
+// Which OAM entries cover each line, kept up to date on OAM writes.
+// The sorted per-line lists are rebuilt lazily from the masks.
+typedef struct {
+    u64 mask[SPRITE_LINES];
+    bool dirty[SPRITE_LINES];
+    sprite_line lines[SPRITE_LINES];
+    u8 height; // sprite height the masks were built for
+} sprite_index;
+
+#define FRAME_BUFFERS 3
+#define FRAME_FRESH 4 // in frame_ready: not yet taken by the presenter
+
+#define DIRTY_WORDS ((SPRITE_LINES + 63) / 64) // one bit per line
 
 typedef struct {
     oam_entry oam_ram[40];
     u8 vram[0x2000];
 
+    sprite_index sprites;
     u8 line_sprite_count; // 0 to 10 sprites.
-    oam_line_entry* line_sprites;
-    oam_line_entry line_entry_array[10];
+    sprite_line* line_sprites;
 
-    u8 fetched_entry_count;
-    oam_entry fetched_entries[3];
+    // Winning sprite pixel per screen x for the current line, 0 if none.
+    // Padded by OVERLAY_PAD on both sides so fetches can run off the edges.
+    u8 sprite_overlay[160 + OVERLAY_PAD * 2];
 
     pixel_fifo_context pfc;
 
     u32 current_frame;
     u32 line_ticks;
-    u32* video_buffer;
+    u64 line_start; // emu tick the current line started on
+    bool dot_active; // mode 3 is running the FIFO dot by dot
     u32 window_line;
+    bool skip_frame;        // the current frame is not being drawn
+    u32 skip_count;
+
+    // Everything above is machine state (PPU_STATE_SIZE), below are the
+    // outputs and settings.
+    u32* video_buffer;   // ARGB output, the back buffer being drawn
+    u8* index_buffer;    // packed shade/palette output when indexed
+
+    // Triple buffering. The renderer owns the back buffer and the presenter
+    // the front one; complete frames are handed over by swapping indices
+    // through frame_ready, so neither side waits or copies.
+    void* frame_buffers[FRAME_BUFFERS];
+    u32 frame_back;
+    u32 frame_ready;
+    u32 frame_front;
+    pthread_mutex_t frame_lock; // only guards frame_cond
+    pthread_cond_t frame_cond;  // signalled when a frame is published
+    bool indexed;
+    ppu_renderer renderer;
+
+    // Change tracking, one hash per finished line.
+    u64 line_hash[SPRITE_LINES];
+    u64 dirty_frame[DIRTY_WORDS]; // lines changed in the frame being drawn
+    u64 dirty_lines[DIRTY_WORDS]; // changed since last taken by a consumer
+    u64 frame_hash;               // hash of the last complete frame
+
+    // Frame skipping. Skipped frames keep exact timing but draw nothing.
+    u32 frame_skip;         // draw 1 of every frame_skip frames, 0 or 1 draws all
+    bool render_on_request; // draw only frames asked for with ppu_request_frame()
+    bool frame_requested;
 } ppu_context;
 
+#define PPU_STATE_SIZE offsetof(ppu_context, video_buffer)
+
+#define LINE_DIRTY(lines, ly) (((lines)[(ly) / 64] >> ((ly) % 64)) & 1)
+
 void ppu_init();
 void ppu_tick();
 ppu_context* ppu_get_context();
 void pipeline_process();
 void pipeline_fifo_reset();
+void pixel_fifo_push(u8 value);
+void ppu_state_loaded();
+
+void ppu_line_done(u8 ly);
+void ppu_frame_done();
+bool ppu_take_dirty_lines(u64* lines);
+bool ppu_acquire_frame();
+bool ppu_wait_frame(u32 timeout_ms);
+const void* ppu_front_buffer();
+void ppu_request_frame();
+
+void sprite_index_reset();
+void sprite_index_remove(u8 entry);
+void sprite_index_add(u8 entry);
+sprite_line* sprite_index_line(u8 ly);
+void sprite_overlay_draw(const sprite_line* line, const oam_entry* oam, const u8* vram,
+    u8 ly, u8 sprite_height, u8* padded);
+void sprite_overlay_build(u8 sprite_height);
+
+void scanline_capture(line_state* state);
+void scanline_draw(const line_state* state, const u8* vram, const oam_entry* oam);
+void scanline_render();
 
 void ppu_oam_write(u16 address, u8 value);
 u8 ppu_oam_read(u16 address);
@@ -90,3 +193,4 @@ u8 ppu_oam_read(u16 address);
 void ppu_vram_write(u16 address, u8 value);
 u8 ppu_vram_read(u16 address);
 bool window_visible();
+bool window_on_line();
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <common.h>
+#include <ppu.h>
+#include <pthread.h>
+
+// Post-frame renderer for --renderer=parallel. Each line's state is
+// captured when its mode 3 starts and all lines are drawn at VBlank on a
+// worker pool. Lines keep the VRAM/OAM they saw through copy-on-write
+// snapshots: a write after a line was captured copies the snapshot first.
+
+#define SNAPSHOT_COUNT (SPRITE_LINES + 1) // one per captured line plus the live one
+#define PARALLEL_MAX_WORKERS 8
+
+typedef struct {
+    u8 vram[0x2000];
+    oam_entry oam_ram[40];
+} vram_snapshot;
+
+typedef struct {
+    line_state state;
+    u8 snapshot;
+} parallel_line;
+
+typedef struct {
+    vram_snapshot* snapshots[SNAPSHOT_COUNT];
+    u8 snapshot_count;    // snapshots used this frame, the last one is live
+    bool snapshot_shared; // the live snapshot is referenced by a captured line
+
+    parallel_line lines[SPRITE_LINES];
+    u32 line_count; // captured so far, emulation thread only
+
+    // A batch is published under lock: generation and batch_lines change
+    // together. next_line holds generation << 32 | next line to take, so
+    // a worker still on an old generation can't claim a new line.
+    u32 generation;
+    u32 batch_lines;
+    u64 next_line;
+    u32 lines_done;
+
+    int worker_count;
+    pthread_t workers[PARALLEL_MAX_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+} parallel_context;
+
+parallel_context* parallel_get_context();
+void parallel_init();
+
+// Drops the lines captured so far and restarts the snapshots from the
+// PPU's VRAM/OAM. Only between frames' rendering, as the workers are idle.
+void parallel_resync();
+
+void parallel_vram_write(u16 address, u8 value);
+void parallel_oam_write(u16 address, u8 value);
+void parallel_capture_line();
+void parallel_render_frame();
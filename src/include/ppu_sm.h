@@ -2,7 +2,14 @@
 
 #include <common.h>
 
-void ppu_mode_oam();
+// Mode transitions are scheduled events, only mode 3 runs per dot.
+void ppu_sm_init();
+void ppu_sm_start(u64 ticks);
+void ppu_sm_stop(u64 ticks);
+void ppu_lcd_enable(bool on);
+
 void ppu_mode_xfer();
-void ppu_mode_hblank();
-void ppu_mode_vblank();
+
+// Mode 3 length in dots for the current line, from SCX, the window and
+// the line's sprites.
+u32 ppu_xfer_length();
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <common.h>
+#include <ppu.h>
+#include <pthread.h>
+
+// Render thread for --renderer=thread. The emulation thread queues every
+// VRAM/OAM write and each line's register state in order; the render
+// thread replays them into its own VRAM/OAM copy and draws the lines.
+// STAT, LY and interrupts never leave the emulation thread.
+
+typedef enum {
+    RQ_VRAM,
+    RQ_OAM,
+    RQ_LINE,
+    RQ_FRAME
+} render_op;
+
+typedef struct {
+    render_op op;
+    union {
+        struct {
+            u16 address;
+            u8 value;
+        } write;
+        line_state line;
+    };
+} render_record;
+
+#define RENDER_QUEUE_SIZE 16384 // records, power of two
+
+// Single producer (emulation thread), single consumer (render thread).
+typedef struct {
+    render_record records[RENDER_QUEUE_SIZE];
+    u32 head __attribute__((aligned(64))); // next slot to write, producer owned
+    u32 tail __attribute__((aligned(64))); // next slot to read, consumer owned
+
+    u8 vram[0x2000];
+    oam_entry oam_ram[40];
+
+    bool running;
+    pthread_t thread;
+    bool sleeping;        // render thread found the queue empty and waits on wake
+    pthread_mutex_t lock; // only guards wake
+    pthread_cond_t wake;
+} render_context;
+
+render_context* render_get_context();
+void render_thread_start();
+void render_thread_stop();
+
+// Waits for the queue to drain, then recopies VRAM/OAM from the PPU.
+void render_thread_resync();
+
+void render_queue_write(render_op op, u16 address, u8 value);
+void render_queue_line();
+void render_queue_frame();
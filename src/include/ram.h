@@ -2,6 +2,13 @@
 
 #include <common.h>
 
+typedef struct {
+    u8 wram[0x2000]; // 8KB Work RAM
+    u8 hram[0x80]; // 2KB High RAM
+} ram_context;
+
+ram_context* ram_get_context();
+
 u8 wram_read(u16 address);
 void wram_write(u16 address, u8 value);
 
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <common.h>
+
+// Link cable play between two processes that only exchange joypad input.
+// Each process simulates both machines, in turns of one frame or, while a
+// serial transfer is going on, one byte (see link_pair in link.h), so
+// both processes compute the same two machines from the same inputs.
+//
+// The remote player's input for a frame is predicted as the last one
+// received. Both machines are snapshotted at the start of every frame;
+// when an input arrives that differs from what was predicted, the
+// snapshot of that frame is restored and the frames since are replayed
+// without pacing, sound or presenting. Running more than
+// ROLLBACK_MAX_FRAMES ahead of the remote input stalls.
+
+#define ROLLBACK_FRAME_TICKS 70224 // one LCD frame, the input period
+#define ROLLBACK_MAX_FRAMES 8
+
+typedef struct {
+    u64 frames;         // frames simulated for the first time
+    u64 rollbacks;
+    u64 depth_total;    // frames replayed
+    u32 depth_max;
+    u64 replay_ns_total;
+    u64 replay_ns_max;
+    u64 snapshots;      // both machines, once per frame simulated
+    u64 snapshot_ns_total;
+    u64 stalls;         // frames that waited for remote input
+} rollback_stats;
+
+// Connects to the other process at addr: a Unix socket path, or a TCP
+// port on the loopback interface when addr is a number. The host is
+// player 1 and waits for player 2 to join. Both sides must run the same
+// ROM and boot ROM; each starts the other's machine with its peer's
+// cartridge RAM. Call after the cartridge is loaded.
+bool rollback_connect(const char* addr, bool host);
+bool rollback_active();
+
+// Runs both machines from power-on until the emulator stops or the peer
+// leaves. Called on the emulation thread after the machine is reset.
+void rollback_run();
+
+rollback_stats* rollback_get_stats();
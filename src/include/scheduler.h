@@ -0,0 +1,45 @@
+#pragma once
+
+#include <common.h>
+
+#define SCHED_NEVER ((u64)-1)
+
+typedef enum {
+    SCHED_PPU,
+    SCHED_APU,
+    SCHED_TIMER,
+    SCHED_SERIAL,
+    SCHED_LINK,
+    SCHED_EVENT_COUNT
+} sched_event;
+
+// Callbacks receive the tick the event was scheduled for.
+typedef void (*sched_callback)(u64 ticks);
+
+typedef struct {
+    u64 when;
+    sched_callback callback;
+} sched_entry;
+
+typedef struct {
+    sched_entry events[SCHED_EVENT_COUNT];
+    u64 next; // earliest pending tick across all events
+} sched_context;
+
+#define SCHED_NO_CALLBACK 0xFF
+
+void sched_init();
+sched_context* sched_get_context();
+
+void sched_add(sched_event ev, u64 when, sched_callback callback);
+void sched_cancel(sched_event ev);
+bool sched_pending(sched_event ev);
+
+// Fire every event due at or before ticks.
+void sched_run(u64 ticks);
+
+// Every callback an event can have, so save states can refer to them by
+// index. Owners register theirs on init.
+void sched_register(sched_event ev, const sched_callback* callbacks, u8 count);
+u8 sched_callback_index(sched_event ev, sched_callback callback);
+sched_callback sched_callback_at(sched_event ev, u8 index); // NULL if unknown
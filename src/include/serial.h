@@ -0,0 +1,23 @@
+#pragma once
+
+#include <common.h>
+
+// DMG internal serial clock, 8192 Hz.
+#define SERIAL_BIT_TICKS 512
+#define SERIAL_BYTE_TICKS (SERIAL_BIT_TICKS * 8)
+
+// An internal clock transfer is one scheduled event (SCHED_SERIAL) at its
+// last bit, SB only changes then. With the external clock the peer on the
+// link drives the transfer, checked every bit period (SCHED_LINK); with no
+// link it never completes, as with no cable.
+typedef struct {
+    u8 sb;
+    u8 sc;
+} serial_context;
+
+void serial_init();
+
+u8 serial_read(u16 address);
+void serial_write(u16 address, u8 value);
+
+serial_context* serial_get_context();
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <common.h>
+#include <pthread.h>
+
+// Pieces shared by the threads that hang off the emulation thread: a
+// lock-free single producer, single consumer ring of stereo frames, and
+// a worker thread that sleeps on a condvar until its producer wakes it.
+
+// head and tail count frames and wrap freely; size is a power of two
+// and frames holds size * 2 samples.
+typedef struct {
+    int16_t* frames;
+    u32 size;
+    u32 head __attribute__((aligned(64))); // producer owned
+    u32 tail __attribute__((aligned(64))); // consumer owned
+} frame_ring;
+
+void frame_ring_init(frame_ring* r, int16_t* frames, u32 size);
+
+// Frames queued, safe from either side.
+u32 frame_ring_fill(frame_ring* r);
+
+// Producer side, copies as many frames as fit and returns how many.
+u32 frame_ring_write(frame_ring* r, const int16_t* frames, u32 n);
+
+// Consumer side, returns the frames read.
+u32 frame_ring_read(frame_ring* r, int16_t* frames, u32 n);
+
+// Consumer side, everything queued in at most two pieces without a copy.
+// Returns the total; frame_ring_consume then hands the space back.
+u32 frame_ring_peek(frame_ring* r, const int16_t* piece[2], u32 count[2]);
+void frame_ring_consume(frame_ring* r, u32 n);
+
+typedef struct {
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t lock; // only guards wake
+    pthread_cond_t wake;
+} worker;
+
+#define WORKER_INIT { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER }
+
+// Exits if the thread can't be created; name is only for the message.
+void worker_start(worker* w, void* (*run)(void*), const char* name);
+
+// Clears running, wakes the thread and joins it. Does nothing if it
+// isn't running.
+void worker_stop(worker* w);
+
+void worker_wake(worker* w);
+
+// Worker side. Sleeps until woken if idle() still holds under the lock,
+// so a wake between the caller's check and the wait isn't lost. Returns
+// false once worker_stop has been called.
+bool worker_wait(worker* w, bool (*idle)(void));
+
+bool worker_running(worker* w);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <common.h>
+
+// Save states. A state is a header followed by sections, each an id, a
+// size and a payload padded to 8 bytes:
+//   EMU  emulator tick count
+//   CPU  cpu_context, the instruction looked up again on load
+//   SCHD when each event is due and which registered callback runs
+//   TIMR, SERL, DMA, LCD, RAM, JOYP, BOOT  the module's context as is
+//   PPU  ppu_context up to PPU_STATE_SIZE, then the current line's
+//        sprite list as a line number and the pixel FIFO's contents
+//   CART bank registers, the ROM bank as an offset into the ROM, the RAM
+//        bank as an index, then the cartridge RAM
+//   APU  the CPU side copy without its step buffers
+//   BLIP the step buffers' used part, only saved while synthesising
+// Payloads are the modules' structs as laid out in memory, so a state
+// loads into a build with the same layout; STATE_VERSION goes up when one
+// changes. Loading checks every section before applying any, and skips
+// ids it does not know. Outputs and settings (frame buffers, renderer,
+// whether sound is synthesised) stay as they are.
+
+#define STATE_MAGIC 0x54534247 // "GBST"
+#define STATE_VERSION 1
+#define STATE_MAX_SIZE 0x40000 // bytes, more than any state needs
+#define STATE_FIFO_MAX 16
+
+// Writes the machine's state to buf, returns its size or 0 if cap is too
+// small. buf must be 8 byte aligned.
+size_t state_save(u8* buf, size_t cap);
+
+// Replaces the machine's state, false if buf does not hold a state for
+// this build and cartridge. buf must be 8 byte aligned.
+bool state_load(const u8* buf, size_t size);
+
+bool state_save_file(const char* path);
+bool state_load_file(const char* path);
@@ -2,15 +2,21 @@
 
 #include <common.h>
 
+// DIV is the low 16 bits of the tick count since div_start and TIMA only
+// catches up when it is accessed; overflows are scheduled events
+// (SCHED_TIMER) recomputed whenever a timer register is written.
 typedef struct {
-    u16 div;
+    u64 div_start;  // tick DIV last read 0
+    u64 tima_ticks; // tick tima is up to date at
     u8 tima;
     u8 tma;
     u8 tac;
 } timer_context;
 
 void timer_init();
-void timer_tick();
+
+u16 timer_div();
+void timer_set_div(u16 div);
 
 void timer_write(u16 address, u8 value);
 u8 timer_read(u16 address);
@@ -5,6 +5,7 @@
 static const int SCREEN_WIDTH = 1024;
 static const int SCREEN_HEIGHT = 768;
 
+void ui_set_vsync(bool on);
 void ui_init();
 void ui_handle_events();
 void ui_update();
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <common.h>
+#include <spsc.h>
+
+// Streams the APU's stereo output to a 16-bit PCM WAV file. The producer
+// only copies blocks into a large queue; a writer thread moves them to
+// disk in big chunks and patches the header sizes after each chunk, so
+// the file stays valid if the process dies mid-run.
+
+#define CAPTURE_QUEUE_FRAMES (1 << 20) // stereo frames, power of two, ~22 s at 48 kHz
+#define CAPTURE_CHUNK_FRAMES (1 << 14) // writer wakes once this much is queued
+
+typedef struct {
+    int16_t frames[CAPTURE_QUEUE_FRAMES * 2];
+    frame_ring queue; // tail counts the frames written
+
+    FILE* file;
+    u64 data_bytes; // PCM bytes on disk
+    worker writer;
+} capture_context;
+
+capture_context* capture_get_context();
+bool wav_capture_start(const char* path, int sample_rate);
+void wav_capture_stop();
+bool wav_capture_active();
+
+// Producer side; waits rather than dropping if the writer falls behind.
+void wav_capture_write(const int16_t* frames, u32 count);
@@ -1,7 +1,14 @@
 #include <apu.h>
 #include <interrupts.h>
 #include <cpu.h>
+#include <emu.h>
+#include <blip.h>
+#include <scheduler.h>
+#include <apu_thread.h>
+#include <wav_capture.h>
+#include <spsc.h>
 #include <string.h>
+#include <stddef.h>
 #include <SDL2/SDL.h>
 
 /* -------------------------
@@ -19,135 +26,123 @@
      NR50 (FF24): master L/R volume (3-bit each), VIN ignored
      NR51 (FF25): route ch1-4 to L/R
      NR52 (FF26): power + ch on flags
+   Synthesis:
+     Channels are run lazily, up to the current tick, whenever a register
+     is touched, the frame sequencer steps or the output is flushed. Each
+     run loops over the points where the channel's output changes and adds
+     only those amplitude deltas to a band-limited step buffer per side.
    SDL:
-     Simple ring buffer + callback. CPU produces samples inside apu_tick()
+     Lock-free single producer, single consumer ring + callback, filled
+     from the step buffers by a scheduled flush every APU_FLUSH_TICKS.
 --------------------------*/
 
-#define RING_SAMPLES   (48000 * 2) // ~1s stereo buffer
+#define RING_FRAMES    65536       // stereo frames, power of two, ~1.4 s at 48 kHz
+#define DRC_MAX_ADJUST 0.005       // rate control moves the ratio by at most 0.5%
+#define DRC_SMOOTHING  0.1         // weight of each new fill reading
+#define DEFAULT_LATENCY_MS 40
+#define FS_PERIOD 8192             // ticks per frame sequencer step, 512 Hz
+#define APU_FLUSH_TICKS 16384      // ticks between moves into the ring, ~4 ms
+#define MIX_UNIT 68                // per volume step and master level, 32767/480
 #define CLAMP(v, lo, hi) ((v)<(lo)?(lo):((v)>(hi)?(hi):(v)))
 
 typedef struct {
-    // Common APU power & mixer
-    bool power;
-    u8 nr50, nr51, nr52;
-
-    // Frame Sequencer
-    u32 fs_cycle_accum;  // tick counter for 512Hz
-    u8  fs_step;         // 0..7
-
     // Sample rate conversion
     int sample_rate;
-    double cycles_per_sample;  // 4194304 / sample_rate
-    double sample_accum;
-    double acc_l, acc_r;        // running sum of instantaneous L/R
-    u32    acc_n;               // how many APU cycles accumulated
-
-    // SDL audio
+    int rate_override;    // from apu_set_sample_rate, 0 for the apu_init rate
+    blip_quality quality;
+    const char* capture_path; // WAV file the output is also written to
+    u64 cycles_per_sample;     // 4194304 / sample_rate nudged by rate control, as a double's bits
+    double base_cycles_per_sample;
+
+    // SDL audio. Whoever synthesises produces, the callback consumes;
+    // the ring is a frame_ring over ring_frames.
     SDL_AudioDeviceID dev;
-    int16_t ring[RING_SAMPLES * 2]; // stereo interleaved
-    volatile u32 rhead, rtail;
-
-    // Channel 1: Square + sweep
-    struct {
-        bool enabled;
-        u8 duty;              // 0..3
-        u16 freq;             // 11-bit
-        u16 timer;            // down-counter
-        u8  duty_pos;         // 0..7
-        u8  length;           // 0..63 (64 steps)
-        bool length_enable;
-
-        // Envelope
-        u8  env_period;       // 0..7 (0 => special means no ticks)
-        u8  env_vol;          // 0..15 current volume
-        bool env_increase;    // true=up, false=down
-        u8  env_counter;      // countdown
-
-        // Sweep
-        u8  sweep_period;     // 0..7
-        bool sweep_negate;
-        u8  sweep_shift;      // 0..7
-        u8  sweep_counter;    // countdown
-        bool sweep_enabled;   // as HW
-
-        // Trigger latch of NRx2 initial volume (for retrigger)
-        u8  init_volume;
-    } ch1;
-
-    // Channel 2: Square (no sweep)
-    struct {
-        bool enabled;
-        u8 duty;
-        u16 freq;
-        u16 timer;
-        u8 duty_pos;
-        u8 length;
-        bool length_enable;
-
-        u8  env_period;
-        u8  env_vol;
-        bool env_increase;
-        u8  env_counter;
-
-        u8  init_volume;
-    } ch2;
-
-    // Channel 3: Wave (stubbed: always zero output)
-    struct {
-        bool enabled;       // NR30 bit7
-        bool dac_on;        // NR30 bit7 (same)
-        u8  length;         // 0..255
-        bool length_enable; // NR34 bit6
-        u16 freq;
-        u16 timer;
-        u8  pos;            // 0..31
-        u8  level;          // NR32 (00:mute, 01:100%, 10:50%, 11:25%)
-        u8  wave_ram[16];   // 32 samples (4-bit) – two per byte
-    } ch3;
-
-    // Channel 4: Noise
-    struct {
-        bool enabled;
-        u8 length;           // 0..63 (64 steps)
-        bool length_enable;
-
-        u8  env_period;
-        u8  env_vol;
-        bool env_increase;
-        u8  env_counter;
-
-        u16 lfsr;            // 15-bit LFSR
-        u8  clock_shift;     // NR43 bits6..4
-        u8  width_mode7;     // NR43 bit3 (1=7-bit)
-        u8  divisor_code;    // NR43 bits2..0 (0=>8)
-        u16 timer;           // noise timer
-    } ch4;
-
+    int16_t ring_frames[RING_FRAMES * 2]; // stereo interleaved
+    frame_ring ring;
+
+    // Glitch counters, each written by one side only.
+    u64 underruns;      // callback side
+    u64 overruns;       // producer side
+    u64 dropped_frames; // producer side
+
+    // Dynamic rate control: the callback measures how much is queued and
+    // steers cycles_per_sample so the queue holds target_fill frames.
+    int latency_ms;
+    u32 target_fill;      // stereo frames
+    double fill_avg;
+    bool primed; // queue reached target_fill, playback running; callback owned
+
+    // Threaded mode: the CPU side copy answers register reads, the audio
+    // thread replays the same writes into its own copy and synthesises.
+    // Muted, nothing synthesises and the CPU side copy is all there is.
+    bool threaded;
+    bool muted;
+    apu_state hw;
+    apu_state synth;
 } apu_t;
 
-static apu_t A;
+static apu_t A = { .quality = BLIP_MEDIUM };
+
+// Producer side. Frames that don't fit are dropped rather than
+// overwriting what is about to play.
+static void ring_write(const int16_t* frames, u32 n) {
+    u32 written = frame_ring_write(&A.ring, frames, n);
+    if (written < n) {
+        __atomic_fetch_add(&A.overruns, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&A.dropped_frames, n - written, __ATOMIC_RELAXED);
+    }
+}
+
+// The callback sets the ratio and synthesis reads it, so it goes through
+// an atomic u64 like the ring indices.
+static void cycles_per_sample_set(double v) {
+    u64 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    __atomic_store_n(&A.cycles_per_sample, bits, __ATOMIC_RELAXED);
+}
+
+static double cycles_per_sample_get(void) {
+    u64 bits = __atomic_load_n(&A.cycles_per_sample, __ATOMIC_RELAXED);
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// ---- dynamic rate control, runs once per callback ----
+static void drc_update(u32 fill) {
+    A.fill_avg += ((double)fill - A.fill_avg) * DRC_SMOOTHING;
+    double err = (A.fill_avg - A.target_fill) / A.target_fill;
+    err = CLAMP(err, -1.0, 1.0);
+    // Too much queued: make fewer samples per emulated second, and the
+    // other way round.
+    cycles_per_sample_set(A.base_cycles_per_sample * (1.0 + DRC_MAX_ADJUST * err));
+}
 
 // ---- SDL audio callback: read from ring buffer ----
 static void sdl_cb(void* userdata, Uint8* stream, int len_bytes) {
     (void)userdata;
     int16_t* out = (int16_t*)stream;
-    int n = len_bytes / sizeof(int16_t);
-    for (int i=0; i<n; i++) {
-        if (A.rtail != A.rhead) {
-            out[i] = A.ring[A.rtail];
-            A.rtail = (A.rtail + 1) % (RING_SAMPLES*2);
-        } else {
-            out[i] = 0;
+    u32 n = len_bytes / (2 * sizeof(int16_t));
+
+    u32 fill = frame_ring_fill(&A.ring);
+    if (!A.primed) {
+        // Build up the target latency before playing, so the first
+        // callbacks don't run dry straight away.
+        if (fill < A.target_fill) {
+            memset(stream, 0, len_bytes);
+            return;
         }
+        A.primed = true;
+        A.fill_avg = fill;
     }
-}
+    drc_update(fill);
 
-static inline void ring_push_stereo(int16_t L, int16_t R) {
-    u32 nh = (A.rhead + 2) % (RING_SAMPLES*2);
-    // overwrite if overrun (simple)
-    A.ring[A.rhead] = L;
-    A.ring[(A.rhead+1)%(RING_SAMPLES*2)] = R;
-    A.rhead = nh;
+    u32 got = frame_ring_read(&A.ring, out, n);
+    if (got < n) {
+        memset(out + got * 2, 0, (n - got) * 2 * sizeof(int16_t));
+        __atomic_fetch_add(&A.underruns, 1, __ATOMIC_RELAXED);
+        A.primed = false; // refill before playing on
+    }
 }
 
 // Duty tables (8-step)
@@ -189,304 +184,290 @@ static void envelope_tick(u8 period, bool increase, u8* env_counter, u8* vol) {
 }
 
 // ---- sweep tick (128 Hz via FS steps 2 & 6) ----
-static bool sweep_apply(void) {
+static bool sweep_apply(apu_state* s) {
     // Compute next freq from current
-    u16 f = A.ch1.freq & 0x7FF;
-    u16 delta = f >> (A.ch1.sweep_shift & 7);
-    if (A.ch1.sweep_negate) {
+    u16 f = s->ch1.freq & 0x7FF;
+    u16 delta = f >> (s->ch1.sweep_shift & 7);
+    if (s->ch1.sweep_negate) {
         f = f - delta;
         if ((int)f < 0) return false;
     } else {
         f = f + delta;
         if (f > 2047) return false;
     }
-    A.ch1.freq = f;
+    s->ch1.freq = f;
     // overflow => disable ch1
     if (f > 2047) return false;
     return true;
 }
 
-static void ch1_sweep_tick(void) {
-    u8 p = A.ch1.sweep_period & 7;
+static void ch1_sweep_tick(apu_state* s) {
+    u8 p = s->ch1.sweep_period & 7;
     if (p == 0) return;
-    if (--A.ch1.sweep_counter == 0) {
-        A.ch1.sweep_counter = p;
-        if (A.ch1.sweep_shift != 0) {
-            if (!sweep_apply()) {
-                A.ch1.enabled = false;
+    if (--s->ch1.sweep_counter == 0) {
+        s->ch1.sweep_counter = p;
+        if (s->ch1.sweep_shift != 0) {
+            if (!sweep_apply(s)) {
+                s->ch1.enabled = false;
             } else {
                 // second calc for overflow check (not applied)
-                u16 save = A.ch1.freq;
-                if (!sweep_apply()) A.ch1.enabled = false;
-                A.ch1.freq = save;
+                u16 save = s->ch1.freq;
+                if (!sweep_apply(s)) s->ch1.enabled = false;
+                s->ch1.freq = save;
             }
         }
     }
 }
 
-// ---- channel outputs (0..15) per channel, unmixed ----
-static inline int ch1_output(void) {
-    if (!A.ch1.enabled) return 0;
-    if (A.ch1.timer == 0) A.ch1.timer = sq_period(A.ch1.freq);
-    // square step
-    if (--A.ch1.timer == 0) {
-        A.ch1.timer = sq_period(A.ch1.freq);
-        A.ch1.duty_pos = (A.ch1.duty_pos + 1) & 7;
+// ---- mixer ----
+// Moves channel ch to a new output level at tick, adding the change on
+// each side it is routed to. NR50/NR51 are applied here, so they cost
+// nothing until they change.
+static void channel_output(apu_state* s, int ch, u8 level, u64 tick) {
+    s->level[ch] = level;
+    if (!s->synth) {
+        return;
     }
-    int bit = DUTY[A.ch1.duty & 3][A.ch1.duty_pos];
-    return bit ? A.ch1.env_vol : 0;
-}
 
-static inline int ch2_output(void) {
-    if (!A.ch2.enabled) return 0;
-    if (A.ch2.timer == 0) A.ch2.timer = sq_period(A.ch2.freq);
-    if (--A.ch2.timer == 0) {
-        A.ch2.timer = sq_period(A.ch2.freq);
-        A.ch2.duty_pos = (A.ch2.duty_pos + 1) & 7;
+    int l = (s->nr51 & (0x10 << ch)) ? level * (((s->nr50 >> 4) & 7) + 1) * MIX_UNIT : 0;
+    int r = (s->nr51 & (0x01 << ch)) ? level * ((s->nr50 & 7) + 1) * MIX_UNIT : 0;
+    u32 t = (u32)(tick - s->frame_start);
+    if (l != s->out_l[ch]) {
+        blip_add_delta(&s->blip_l, t, l - s->out_l[ch]);
+        s->out_l[ch] = l;
+    }
+    if (r != s->out_r[ch]) {
+        blip_add_delta(&s->blip_r, t, r - s->out_r[ch]);
+        s->out_r[ch] = r;
     }
-    int bit = DUTY[A.ch2.duty & 3][A.ch2.duty_pos];
-    return bit ? A.ch2.env_vol : 0;
-}
-
-static inline int ch3_output(void) {
-    // Stub: return 0 until you wire NR30-34 fully
-    (void)A;
-    return 0;
 }
 
-static inline int ch4_output(void) {
-    if (!A.ch4.enabled) return 0;
-    // timer
-    if (A.ch4.timer == 0) {
-        A.ch4.timer = noise_period(A.ch4.divisor_code, A.ch4.clock_shift);
-    }
-    if (--A.ch4.timer == 0) {
-        A.ch4.timer = noise_period(A.ch4.divisor_code, A.ch4.clock_shift);
-        // 15-bit LFSR tap xor (bit0 ^ bit1) then shift in
-        u16 x = (A.ch4.lfsr ^ (A.ch4.lfsr >> 1)) & 1;
-        A.ch4.lfsr = (A.ch4.lfsr >> 1) | (x << 14);
-        if (A.ch4.width_mode7) {
-            // also set bit6 (7-bit mode)
-            A.ch4.lfsr = (A.ch4.lfsr & ~(1<<6)) | (x << 6);
-        }
+static inline void channel_set(apu_state* s, int ch, u8 level, u64 tick) {
+    if (level != s->level[ch]) {
+        channel_output(s, ch, level, tick);
     }
-    int out = (~A.ch4.lfsr) & 1; // bit0 inverted -> 1 is "high"
-    return out ? A.ch4.env_vol : 0;
 }
 
-// ---- mixer ----
-static void mix_and_push_sample(void) {
-    // Per-channel dry values (0..15)
-    int s1 = ch1_output();
-    int s2 = ch2_output();
-    int s3 = ch3_output();
-    int s4 = ch4_output();
-
-    // NR51 routing
-    int l = 0, r = 0;
-    if (A.nr51 & (1<<4)) l += s1; if (A.nr51 & (1<<0)) r += s1;
-    if (A.nr51 & (1<<5)) l += s2; if (A.nr51 & (1<<1)) r += s2;
-    if (A.nr51 & (1<<6)) l += s3; if (A.nr51 & (1<<2)) r += s3;
-    if (A.nr51 & (1<<7)) l += s4; if (A.nr51 & (1<<3)) r += s4;
-
-    // NR50 master volume 0..7 -> simply scale
-    int lv = (A.nr50 >> 4) & 7;
-    int rv = (A.nr50 >> 0) & 7;
+static inline u8 square_level(bool enabled, u8 duty, u8 duty_pos, u8 vol) {
+    return enabled && DUTY[duty & 3][duty_pos] ? (vol & 0x0F) : 0;
+}
 
-    // crude normalisation: each channel 0..15, 4 channels sum 0..60
-    // scale by (master+1)/8 to get 0..1, then to int16
-    float lf = (l / 60.0f) * ((lv + 1) / 8.0f);
-    float rf = (r / 60.0f) * ((rv + 1) / 8.0f);
+static inline u8 wave_level(const apu_state* s) {
+    if (!s->ch3.enabled || !s->ch3.dac_on || !s->ch3.level) return 0;
+    u8 b = s->ch3.wave_ram[s->ch3.pos >> 1];
+    u8 sample = (s->ch3.pos & 1) ? (b & 0x0F) : (b >> 4);
+    return sample >> (s->ch3.level - 1);
+}
 
-    int16_t L = (int16_t)CLAMP((int)(lf * 32767.0f), -32768, 32767);
-    int16_t R = (int16_t)CLAMP((int)(rf * 32767.0f), -32768, 32767);
+static inline u8 noise_level(const apu_state* s) {
+    // DMG high when bit0==0
+    return s->ch4.enabled && !(s->ch4.lfsr & 1) ? (s->ch4.env_vol & 0x0F) : 0;
+}
 
-    ring_push_stereo(L, R);
+// Re-evaluates every channel after registers, envelopes or routing changed.
+static void mix_refresh(apu_state* s, u64 tick) {
+    channel_output(s, 0, square_level(s->ch1.enabled, s->ch1.duty, s->ch1.duty_pos, s->ch1.env_vol), tick);
+    channel_output(s, 1, square_level(s->ch2.enabled, s->ch2.duty, s->ch2.duty_pos, s->ch2.env_vol), tick);
+    channel_output(s, 2, wave_level(s), tick);
+    channel_output(s, 3, noise_level(s), tick);
 }
 
 // ---- frame sequencer step ----
-static void fs_step(void) {
+static void fs_step(apu_state* s) {
     // length @ 0,2,4,6
-    if ((A.fs_step & 1) == 0) {
-        chx_length_tick(&A.ch1.length, A.ch1.length_enable, &A.ch1.enabled);
-        chx_length_tick(&A.ch2.length, A.ch2.length_enable, &A.ch2.enabled);
-        chx_length_tick(&A.ch4.length, A.ch4.length_enable, &A.ch4.enabled);
+    if ((s->fs_step & 1) == 0) {
+        chx_length_tick(&s->ch1.length, s->ch1.length_enable, &s->ch1.enabled);
+        chx_length_tick(&s->ch2.length, s->ch2.length_enable, &s->ch2.enabled);
+        chx_length_tick(&s->ch4.length, s->ch4.length_enable, &s->ch4.enabled);
         // ch3 stubbed
     }
     // sweep @ 2,6
-    if (A.fs_step == 2 || A.fs_step == 6) {
-        ch1_sweep_tick();
+    if (s->fs_step == 2 || s->fs_step == 6) {
+        ch1_sweep_tick(s);
     }
     // envelope @ 7
-    if (A.fs_step == 7) {
-        envelope_tick(A.ch1.env_period, A.ch1.env_increase, &A.ch1.env_counter, &A.ch1.env_vol);
-        envelope_tick(A.ch2.env_period, A.ch2.env_increase, &A.ch2.env_counter, &A.ch2.env_vol);
-        envelope_tick(A.ch4.env_period, A.ch4.env_increase, &A.ch4.env_counter, &A.ch4.env_vol);
+    if (s->fs_step == 7) {
+        envelope_tick(s->ch1.env_period, s->ch1.env_increase, &s->ch1.env_counter, &s->ch1.env_vol);
+        envelope_tick(s->ch2.env_period, s->ch2.env_increase, &s->ch2.env_counter, &s->ch2.env_vol);
+        envelope_tick(s->ch4.env_period, s->ch4.env_increase, &s->ch4.env_counter, &s->ch4.env_vol);
     }
-    A.fs_step = (A.fs_step + 1) & 7;
+    s->fs_step = (s->fs_step + 1) & 7;
 }
 
-// ---- public API ----
-void apu_init(int sample_rate) {
-    memset(&A, 0, sizeof(A));
-    A.sample_rate = sample_rate <= 0 ? 48000 : sample_rate;
-    A.cycles_per_sample = (double)APU_CLOCK_HZ / (double)A.sample_rate;
+// Power-on register state.
+static void state_reset(apu_state* s) {
+    s->power = true;
+    s->nr50 = 0x77; // max volumes by default
+    s->nr51 = 0xF3; // typical route (ch1-4 -> R/L), tweak as you like
+    s->nr52 = 0x80; // power bit set
 
-    SDL_AudioSpec want = {0}, have = {0};
-    want.freq = A.sample_rate;
-    want.format = AUDIO_S16SYS;
-    want.channels = 2;
-    want.samples = 1024; // callback chunk
-    want.callback = sdl_cb;
-    A.dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
-    if (A.dev) SDL_PauseAudioDevice(A.dev, 0);
+    s->fs_next = s->ticks + FS_PERIOD;
+    s->fs_step = 0;
 
-    apu_reset();
+    // Channel defaults
+    memset(&s->ch1, 0, sizeof(s->ch1));
+    memset(&s->ch2, 0, sizeof(s->ch2));
+    memset(&s->ch3, 0, sizeof(s->ch3));
+    memset(&s->ch4, 0, sizeof(s->ch4));
+    s->ch4.lfsr = 0x7FFF;
+    mix_refresh(s, s->ticks);
 }
 
-void apu_reset(void) {
-    // Power on
-    A.power = true;
-    A.acc_l = A.acc_r = 0.0;
-    A.acc_n = 0;
-    A.nr50 = 0x77; // max volumes by default
-    A.nr51 = 0xF3; // typical route (ch1-4 -> R/L), tweak as you like
-    A.nr52 = 0x80; // power bit set
-
-    A.fs_cycle_accum = 0;
-    A.fs_step = 0;
-    A.sample_accum = 0.0;
-    A.rhead = A.rtail = 0;
+// ---- channel runs ----
+// Timers count down as on hardware: a channel steps when its timer runs
+// out and reloads it with the current period. Runs jump from one step to
+// the next instead of visiting every tick.
 
-    // Channel defaults
-    memset(&A.ch1, 0, sizeof(A.ch1));
-    memset(&A.ch2, 0, sizeof(A.ch2));
-    memset(&A.ch3, 0, sizeof(A.ch3));
-    memset(&A.ch4, 0, sizeof(A.ch4));
-    A.ch4.lfsr = 0x7FFF;
-}
+static void square_run(apu_state* s, int ch, bool enabled, u16 freq, u8 duty, u8 vol,
+    u16* timer, u8* duty_pos, u64 from, u64 to) {
+    if (!enabled) return;
+    u32 period = (2048 - (freq & 0x7FF)) << 2;
+    u32 t = *timer ? *timer : period;
+    u64 left = to - from;
 
-static inline void ch1_step_1cycle(void) {
-    if (!A.ch1.enabled) return;
-    if (A.ch1.timer == 0) A.ch1.timer = (2048 - (A.ch1.freq & 0x7FF)) << 2;
-    if (--A.ch1.timer == 0) {
-        A.ch1.timer = (2048 - (A.ch1.freq & 0x7FF)) << 2;
-        A.ch1.duty_pos = (A.ch1.duty_pos + 1) & 7;
+    if (left < t) {
+        *timer = t - left;
+        return;
+    }
+    if ((vol & 0x0F) == 0) {
+        // Silent, only the duty position moves.
+        u64 steps = 1 + (left - t) / period;
+        *duty_pos = (*duty_pos + steps) & 7;
+        *timer = period - (left - t) % period;
+        return;
     }
-}
 
-static inline void ch2_step_1cycle(void) {
-    if (!A.ch2.enabled) return;
-    if (A.ch2.timer == 0) A.ch2.timer = (2048 - (A.ch2.freq & 0x7FF)) << 2;
-    if (--A.ch2.timer == 0) {
-        A.ch2.timer = (2048 - (A.ch2.freq & 0x7FF)) << 2;
-        A.ch2.duty_pos = (A.ch2.duty_pos + 1) & 7;
+    u64 tick = from;
+    while (to - tick >= t) {
+        tick += t;
+        t = period;
+        *duty_pos = (*duty_pos + 1) & 7;
+        channel_set(s, ch, square_level(true, duty, *duty_pos, vol), tick);
     }
+    *timer = t - (to - tick);
 }
 
-static inline void ch3_step_1cycle(void) {
-    if (!A.ch3.enabled || !A.ch3.dac_on) return;
-    if (A.ch3.timer == 0) {
-        u16 base = 2048 - (A.ch3.freq & 0x7FF);
-        A.ch3.timer = base ? (base << 1) : 2;
+static void wave_run(apu_state* s, u64 from, u64 to) {
+    if (!s->ch3.enabled || !s->ch3.dac_on) return;
+    u32 period = (2048 - (s->ch3.freq & 0x7FF)) << 1;
+    u32 t = s->ch3.timer ? s->ch3.timer : period;
+    u64 left = to - from;
+
+    if (left < t) {
+        s->ch3.timer = t - left;
+        return;
     }
-    if (--A.ch3.timer == 0) {
-        u16 base = 2048 - (A.ch3.freq & 0x7FF);
-        A.ch3.timer = base ? (base << 1) : 2;
-        A.ch3.pos = (A.ch3.pos + 1) & 31;
+    if (!s->ch3.level) {
+        // Muted, only the sample position moves.
+        u64 steps = 1 + (left - t) / period;
+        s->ch3.pos = (s->ch3.pos + steps) & 31;
+        s->ch3.timer = period - (left - t) % period;
+        return;
     }
-}
 
-static inline void ch4_step_1cycle(void) {
-    if (!A.ch4.enabled) return;
-    if (A.ch4.timer == 0) {
-        static const int divs[8] = {8,16,32,48,64,80,96,112};
-        A.ch4.timer = (u16)(divs[A.ch4.divisor_code & 7] << (A.ch4.clock_shift & 0xF));
+    u64 tick = from;
+    while (to - tick >= t) {
+        tick += t;
+        t = period;
+        s->ch3.pos = (s->ch3.pos + 1) & 31;
+        channel_set(s, 2, wave_level(s), tick);
     }
-    if (--A.ch4.timer == 0) {
-        static const int divs[8] = {8,16,32,48,64,80,96,112};
-        A.ch4.timer = (u16)(divs[A.ch4.divisor_code & 7] << (A.ch4.clock_shift & 0xF));
-        u16 x = (A.ch4.lfsr ^ (A.ch4.lfsr >> 1)) & 1;
-        A.ch4.lfsr = (A.ch4.lfsr >> 1) | (x << 14);
-        if (A.ch4.width_mode7) {
-            A.ch4.lfsr = (A.ch4.lfsr & ~(1<<6)) | (x << 6);
+    s->ch3.timer = t - (to - tick);
+}
+
+static void noise_run(apu_state* s, u64 from, u64 to) {
+    if (!s->ch4.enabled) return;
+    // A period that truncates to 0 wraps the 16-bit timer: 65536 ticks.
+    u32 period = noise_period(s->ch4.divisor_code, s->ch4.clock_shift);
+    if (!period) period = 0x10000;
+    u32 t = s->ch4.timer ? s->ch4.timer : period;
+
+    // The LFSR has to be clocked even when silent, its state is audible
+    // later.
+    u64 tick = from;
+    while (to - tick >= t) {
+        tick += t;
+        t = period;
+        u16 x = (s->ch4.lfsr ^ (s->ch4.lfsr >> 1)) & 1;
+        s->ch4.lfsr = (s->ch4.lfsr >> 1) | (x << 14);
+        if (s->ch4.width_mode7) {
+            s->ch4.lfsr = (s->ch4.lfsr & ~(1<<6)) | (x << 6);
         }
+        channel_set(s, 3, noise_level(s), tick);
     }
+    s->ch4.timer = (u16)(t - (to - tick)); // 0x10000 stores as 0, same thing
 }
 
-
-void apu_tick(void) {
-    if (!A.power) return;
-
-    // 512 Hz frame sequencer
-    if (++A.fs_cycle_accum >= 8192) {
-        A.fs_cycle_accum = 0;
-        fs_step(); // your existing length/sweep/envelope ticks
+// Steps the channels through every tick up to and including to.
+static void channels_run(apu_state* s, u64 to) {
+    if (to <= s->ticks) return;
+    if (s->synth) {
+        u64 from = s->ticks;
+        square_run(s, 0, s->ch1.enabled, s->ch1.freq, s->ch1.duty, s->ch1.env_vol,
+            &s->ch1.timer, &s->ch1.duty_pos, from, to);
+        square_run(s, 1, s->ch2.enabled, s->ch2.freq, s->ch2.duty, s->ch2.env_vol,
+            &s->ch2.timer, &s->ch2.duty_pos, from, to);
+        wave_run(s, from, to);
+        noise_run(s, from, to);
     }
+    s->ticks = to;
+}
 
-    // --- step channels one APU cycle ---
-    ch1_step_1cycle();
-    ch2_step_1cycle();
-    ch3_step_1cycle();
-    ch4_step_1cycle();
-
-    // --- compute instantaneous output for THIS cycle ---
-    int s1 = 0, s2 = 0, s3 = 0, s4 = 0;
-
-    if (A.ch1.enabled) {
-        int bit = DUTY[A.ch1.duty & 3][A.ch1.duty_pos];
-        s1 = bit ? (A.ch1.env_vol & 0x0F) : 0;
-    }
-    if (A.ch2.enabled) {
-        int bit = DUTY[A.ch2.duty & 3][A.ch2.duty_pos];
-        s2 = bit ? (A.ch2.env_vol & 0x0F) : 0;
-    }
-    if (A.ch3.enabled && A.ch3.dac_on) {
-        u8 b = A.ch3.wave_ram[A.ch3.pos >> 1];
-        u8 s4 = (A.ch3.pos & 1) ? (b & 0x0F) : (b >> 4);
-        switch (A.ch3.level) { case 0: s3=0; break; case 1: s3=s4; break; case 2: s3=s4>>1; break; case 3: s3=s4>>2; break; }
+// Brings the APU up to ticks. Frame sequencer steps happen before the
+// channels step on the same tick.
+static void apu_run(apu_state* s, u64 ticks) {
+    while (s->power && s->fs_next <= ticks) {
+        channels_run(s, s->fs_next - 1);
+        fs_step(s);
+        mix_refresh(s, s->fs_next);
+        s->fs_next += FS_PERIOD;
     }
-    if (A.ch4.enabled) {
-        int out = (~A.ch4.lfsr) & 1; // DMG high when bit0==0
-        s4 = out ? (A.ch4.env_vol & 0x0F) : 0;
-    }
-
-    // route & scale this cycle
-    int l = 0, r = 0;
-    if (A.nr51 & (1<<4)) l += s1; if (A.nr51 & (1<<0)) r += s1;
-    if (A.nr51 & (1<<5)) l += s2; if (A.nr51 & (1<<1)) r += s2;
-    if (A.nr51 & (1<<6)) l += s3; if (A.nr51 & (1<<2)) r += s3;
-    if (A.nr51 & (1<<7)) l += s4; if (A.nr51 & (1<<3)) r += s4;
-
-    int lv = (A.nr50 >> 4) & 7;
-    int rv = (A.nr50 >> 0) & 7;
-    // normalise to 0..1 per cycle
-    double lf = (l / 60.0) * ((lv + 1) / 8.0);
-    double rf = (r / 60.0) * ((rv + 1) / 8.0);
+    channels_run(s, ticks);
+}
 
-    // accumulate for resampling
-    A.acc_l += lf;
-    A.acc_r += rf;
-    A.acc_n += 1;
+// ---- output ----
+// Synthesises up to ticks and moves the finished samples into the ring.
+static void synth_flush(apu_state* s, u64 ticks) {
+    static int16_t block[BLIP_SIZE * 2];
+
+    apu_run(s, ticks);
+    blip_end_frame(&s->blip_l, (u32)(ticks - s->frame_start));
+    blip_end_frame(&s->blip_r, (u32)(ticks - s->frame_start));
+    s->frame_start = ticks;
+
+    int n = blip_read_samples(&s->blip_l, block, BLIP_SIZE, 2);
+    blip_read_samples(&s->blip_r, block + 1, n, 2);
+    if (!emu_get_context()->shadow) { // replayed or unheard output is dropped
+        if (wav_capture_active()) {
+            wav_capture_write(block, n);
+        }
+        if (A.dev) {
+            ring_write(block, n);
+        }
+    }
 
-    // produce one PCM sample when enough APU cycles elapsed
-    A.sample_accum += 1.0;
-    if (A.sample_accum >= A.cycles_per_sample) {
-        double nsamp = A.acc_n ? (double)A.acc_n : 1.0;
-        double Lf = A.acc_l / nsamp;
-        double Rf = A.acc_r / nsamp;
+    // Rate control applies from the next block on.
+    double rate = 1.0 / cycles_per_sample_get();
+    blip_set_rate(&s->blip_l, rate);
+    blip_set_rate(&s->blip_r, rate);
+}
 
-        int16_t L = (int16_t)CLAMP((int)(Lf * 32767.0), -32768, 32767);
-        int16_t R = (int16_t)CLAMP((int)(Rf * 32767.0), -32768, 32767);
-        ring_push_stereo(L, R);
+static void synth_init(apu_state* s) {
+    s->synth = true;
+    blip_init(&s->blip_l, 1.0 / cycles_per_sample_get());
+    blip_init(&s->blip_r, 1.0 / cycles_per_sample_get());
+}
 
-        A.sample_accum -= A.cycles_per_sample;
-        A.acc_l = A.acc_r = 0.0;
-        A.acc_n = 0;
+// Scheduled every APU_FLUSH_TICKS.
+static void apu_flush(u64 ticks) {
+    if (A.threaded) {
+        apu_queue_sync(ticks);
+    } else {
+        synth_flush(&A.hw, ticks);
     }
+    sched_add(SCHED_APU, ticks + APU_FLUSH_TICKS, apu_flush);
 }
 
-
 /* ---------------- I/O mapping ----------------
    Ch1: FF10..FF14
    Ch2: FF16..FF19
@@ -496,173 +477,352 @@ void apu_tick(void) {
 ------------------------------------------------*/
 
 u8 apu_io_read(u16 a) {
-    if (a == 0xFF26) return (A.power ? 0x80 : 0x00)
-        | (A.ch1.enabled?1:0) | ((A.ch2.enabled?1:0)<<1)
-        | ((A.ch3.enabled?1:0)<<2) | ((A.ch4.enabled?1:0)<<3);
-    if (a == 0xFF24) return A.nr50;
-    if (a == 0xFF25) return A.nr51;
+    apu_state* s = &A.hw;
+    apu_run(s, emu_get_context()->ticks); // length counters may have run out
+    if (a == 0xFF26) return (s->power ? 0x80 : 0x00)
+        | (s->ch1.enabled?1:0) | ((s->ch2.enabled?1:0)<<1)
+        | ((s->ch3.enabled?1:0)<<2) | ((s->ch4.enabled?1:0)<<3);
+    if (a == 0xFF24) return s->nr50;
+    if (a == 0xFF25) return s->nr51;
 
     // For simplicity return reasonable shadows; many regs read back as last written
     switch (a) {
-        case 0xFF10: return (A.ch1.sweep_period<<4) | (A.ch1.sweep_negate?0x08:0) | (A.ch1.sweep_shift & 7);
-        case 0xFF11: return (A.ch1.duty<<6) | (64 - (A.ch1.length?A.ch1.length:64));
-        case 0xFF12: return (A.ch1.init_volume<<4) | (A.ch1.env_increase?0x08:0) | (A.ch1.env_period & 7);
-        case 0xFF13: return A.ch1.freq & 0xFF;
-        case 0xFF14: return (A.ch1.length_enable?0x40:0) | ((A.ch1.freq>>8)&7);
+        case 0xFF10: return (s->ch1.sweep_period<<4) | (s->ch1.sweep_negate?0x08:0) | (s->ch1.sweep_shift & 7);
+        case 0xFF11: return (s->ch1.duty<<6) | (64 - (s->ch1.length?s->ch1.length:64));
+        case 0xFF12: return (s->ch1.init_volume<<4) | (s->ch1.env_increase?0x08:0) | (s->ch1.env_period & 7);
+        case 0xFF13: return s->ch1.freq & 0xFF;
+        case 0xFF14: return (s->ch1.length_enable?0x40:0) | ((s->ch1.freq>>8)&7);
 
-        case 0xFF16: return (A.ch2.duty<<6) | (64 - (A.ch2.length?A.ch2.length:64));
-        case 0xFF17: return (A.ch2.init_volume<<4) | (A.ch2.env_increase?0x08:0) | (A.ch2.env_period & 7);
-        case 0xFF18: return A.ch2.freq & 0xFF;
-        case 0xFF19: return (A.ch2.length_enable?0x40:0) | ((A.ch2.freq>>8)&7);
+        case 0xFF16: return (s->ch2.duty<<6) | (64 - (s->ch2.length?s->ch2.length:64));
+        case 0xFF17: return (s->ch2.init_volume<<4) | (s->ch2.env_increase?0x08:0) | (s->ch2.env_period & 7);
+        case 0xFF18: return s->ch2.freq & 0xFF;
+        case 0xFF19: return (s->ch2.length_enable?0x40:0) | ((s->ch2.freq>>8)&7);
 
         // Wave and noise readbacks omitted/minimal
         default: return 0xFF;
     }
 }
 
-static void ch1_trigger(void) {
-    A.ch1.enabled = true;
-    if (A.ch1.length == 0) A.ch1.length = 64;
-    A.ch1.timer = sq_period(A.ch1.freq);
-    A.ch1.duty_pos = 0;
+static void ch1_trigger(apu_state* s) {
+    s->ch1.enabled = true;
+    if (s->ch1.length == 0) s->ch1.length = 64;
+    s->ch1.timer = sq_period(s->ch1.freq);
+    s->ch1.duty_pos = 0;
     // Envelope reload
-    A.ch1.env_vol = A.ch1.init_volume & 0x0F;
-    A.ch1.env_counter = A.ch1.env_period ? A.ch1.env_period : 8;
+    s->ch1.env_vol = s->ch1.init_volume & 0x0F;
+    s->ch1.env_counter = s->ch1.env_period ? s->ch1.env_period : 8;
     // Sweep init
-    A.ch1.sweep_counter = (A.ch1.sweep_period ? A.ch1.sweep_period : 8);
-    A.ch1.sweep_enabled = (A.ch1.sweep_period || A.ch1.sweep_shift);
-    if (A.ch1.sweep_shift) {
+    s->ch1.sweep_counter = (s->ch1.sweep_period ? s->ch1.sweep_period : 8);
+    s->ch1.sweep_enabled = (s->ch1.sweep_period || s->ch1.sweep_shift);
+    if (s->ch1.sweep_shift) {
         // pre-calc overflow check
-        u16 save = A.ch1.freq;
-        if (!sweep_apply()) A.ch1.enabled = false;
-        A.ch1.freq = save;
+        u16 save = s->ch1.freq;
+        if (!sweep_apply(s)) s->ch1.enabled = false;
+        s->ch1.freq = save;
     }
 }
 
-static void ch2_trigger(void) {
-    A.ch2.enabled = true;
-    if (A.ch2.length == 0) A.ch2.length = 64;
-    A.ch2.timer = sq_period(A.ch2.freq);
-    A.ch2.duty_pos = 0;
-    A.ch2.env_vol = A.ch2.init_volume & 0x0F;
-    A.ch2.env_counter = A.ch2.env_period ? A.ch2.env_period : 8;
+static void ch2_trigger(apu_state* s) {
+    s->ch2.enabled = true;
+    if (s->ch2.length == 0) s->ch2.length = 64;
+    s->ch2.timer = sq_period(s->ch2.freq);
+    s->ch2.duty_pos = 0;
+    s->ch2.env_vol = s->ch2.init_volume & 0x0F;
+    s->ch2.env_counter = s->ch2.env_period ? s->ch2.env_period : 8;
 }
 
-static void ch4_trigger(void) {
-    A.ch4.enabled = true;
-    if (A.ch4.length == 0) A.ch4.length = 64;
-    A.ch4.lfsr = 0x7FFF;
-    A.ch4.timer = noise_period(A.ch4.divisor_code, A.ch4.clock_shift);
-    A.ch4.env_vol = A.ch4.env_vol & 0x0F; // keep last
-    A.ch4.env_counter = A.ch4.env_period ? A.ch4.env_period : 8;
+static void ch4_trigger(apu_state* s) {
+    s->ch4.enabled = true;
+    if (s->ch4.length == 0) s->ch4.length = 64;
+    s->ch4.lfsr = 0x7FFF;
+    s->ch4.timer = noise_period(s->ch4.divisor_code, s->ch4.clock_shift);
+    s->ch4.env_vol = s->ch4.env_vol & 0x0F; // keep last
+    s->ch4.env_counter = s->ch4.env_period ? s->ch4.env_period : 8;
 }
 
-void apu_io_write(u16 a, u8 v) {
+static void state_write(apu_state* s, u16 a, u8 v) {
     if (a == 0xFF26) {
         bool new_power = (v & 0x80) != 0;
         if (!new_power) {
             // power off: clear everything
-            apu_reset();
-            A.power = false;
-            A.nr52 = 0x00;
+            state_reset(s);
+            s->power = false;
+            s->nr52 = 0x00;
         } else {
-            A.power = true;
-            A.nr52 = 0x80;
+            if (!s->power) {
+                s->fs_next = s->ticks + FS_PERIOD;
+            }
+            s->power = true;
+            s->nr52 = 0x80;
         }
         return;
     }
-    if (!A.power) return; // writes ignored when power=0, except FF26
+    if (!s->power) return; // writes ignored when power=0, except FF26
 
     switch (a) {
         // Ch1 sweep
         case 0xFF10:
-            A.ch1.sweep_period = (v >> 4) & 7;
-            A.ch1.sweep_negate = (v & 0x08) != 0;
-            A.ch1.sweep_shift  = v & 7;
+            s->ch1.sweep_period = (v >> 4) & 7;
+            s->ch1.sweep_negate = (v & 0x08) != 0;
+            s->ch1.sweep_shift  = v & 7;
             break;
         // Ch1 duty/length
         case 0xFF11:
-            A.ch1.duty   = (v >> 6) & 3;
-            A.ch1.length = 64 - (v & 0x3F);
+            s->ch1.duty   = (v >> 6) & 3;
+            s->ch1.length = 64 - (v & 0x3F);
             break;
         // Ch1 envelope
         case 0xFF12:
-            A.ch1.init_volume = (v >> 4) & 0x0F;
-            A.ch1.env_increase = (v & 0x08) != 0;
-            A.ch1.env_period = v & 7;
-            if ((v & 0xF8) == 0) { A.ch1.enabled = false; } // DAC off -> channel off
+            s->ch1.init_volume = (v >> 4) & 0x0F;
+            s->ch1.env_increase = (v & 0x08) != 0;
+            s->ch1.env_period = v & 7;
+            if ((v & 0xF8) == 0) { s->ch1.enabled = false; } // DAC off -> channel off
             break;
         // Ch1 freq lo
         case 0xFF13:
-            A.ch1.freq = (A.ch1.freq & 0x0700) | v;
+            s->ch1.freq = (s->ch1.freq & 0x0700) | v;
             break;
         // Ch1 trigger / hi
         case 0xFF14:
-            A.ch1.length_enable = (v & 0x40) != 0;
-            A.ch1.freq = (A.ch1.freq & 0x00FF) | ((v & 7) << 8);
-            if (v & 0x80) ch1_trigger();
+            s->ch1.length_enable = (v & 0x40) != 0;
+            s->ch1.freq = (s->ch1.freq & 0x00FF) | ((v & 7) << 8);
+            if (v & 0x80) ch1_trigger(s);
             break;
 
         // Ch2 duty/length
         case 0xFF16:
-            A.ch2.duty   = (v >> 6) & 3;
-            A.ch2.length = 64 - (v & 0x3F);
+            s->ch2.duty   = (v >> 6) & 3;
+            s->ch2.length = 64 - (v & 0x3F);
             break;
         // Ch2 envelope
         case 0xFF17:
-            A.ch2.init_volume = (v >> 4) & 0x0F;
-            A.ch2.env_increase = (v & 0x08) != 0;
-            A.ch2.env_period = v & 7;
-            if ((v & 0xF8) == 0) { A.ch2.enabled = false; }
+            s->ch2.init_volume = (v >> 4) & 0x0F;
+            s->ch2.env_increase = (v & 0x08) != 0;
+            s->ch2.env_period = v & 7;
+            if ((v & 0xF8) == 0) { s->ch2.enabled = false; }
             break;
         case 0xFF18:
-            A.ch2.freq = (A.ch2.freq & 0x0700) | v;
+            s->ch2.freq = (s->ch2.freq & 0x0700) | v;
             break;
         case 0xFF19:
-            A.ch2.length_enable = (v & 0x40) != 0;
-            A.ch2.freq = (A.ch2.freq & 0x00FF) | ((v & 7) << 8);
-            if (v & 0x80) ch2_trigger();
+            s->ch2.length_enable = (v & 0x40) != 0;
+            s->ch2.freq = (s->ch2.freq & 0x00FF) | ((v & 7) << 8);
+            if (v & 0x80) ch2_trigger(s);
             break;
 
         // Wave (stub) FF1A..FF1E: accept writes to look less broken, no output yet
-        case 0xFF1A: A.ch3.dac_on = (v & 0x80)!=0; if (!A.ch3.dac_on) A.ch3.enabled=false; break;
-        case 0xFF1B: A.ch3.length = 256 - v; break;
-        case 0xFF1C: A.ch3.level  = (v >> 5) & 3; break;
-        case 0xFF1D: A.ch3.freq   = (A.ch3.freq & 0x0700) | v; break;
+        case 0xFF1A: s->ch3.dac_on = (v & 0x80)!=0; if (!s->ch3.dac_on) s->ch3.enabled=false; break;
+        case 0xFF1B: s->ch3.length = 256 - v; break;
+        case 0xFF1C: s->ch3.level  = (v >> 5) & 3; break;
+        case 0xFF1D: s->ch3.freq   = (s->ch3.freq & 0x0700) | v; break;
         case 0xFF1E:
-            A.ch3.length_enable = (v & 0x40)!=0;
-            A.ch3.freq = (A.ch3.freq & 0x00FF) | ((v & 7) << 8);
+            s->ch3.length_enable = (v & 0x40)!=0;
+            s->ch3.freq = (s->ch3.freq & 0x00FF) | ((v & 7) << 8);
             if (v & 0x80) { // trigger
-                A.ch3.enabled = A.ch3.dac_on;
-                if (A.ch3.length==0) A.ch3.length = (u8)256;
-                A.ch3.pos=0;
-                u16 base=2048-(A.ch3.freq&0x7FF); A.ch3.timer = base? (base<<1):2;
+                s->ch3.enabled = s->ch3.dac_on;
+                if (s->ch3.length==0) s->ch3.length = (u8)256;
+                s->ch3.pos=0;
+                u16 base=2048-(s->ch3.freq&0x7FF); s->ch3.timer = base? (base<<1):2;
             }
             break;
         // Noise
         case 0xFF20: // NR41 length
-            A.ch4.length = 64 - (v & 0x3F);
+            s->ch4.length = 64 - (v & 0x3F);
             break;
         case 0xFF21: // NR42 envelope
-            A.ch4.env_vol = (v >> 4) & 0x0F;
-            A.ch4.env_increase = (v & 0x08) != 0;
-            A.ch4.env_period = v & 7;
-            if ((v & 0xF8) == 0) { A.ch4.enabled = false; }
+            s->ch4.env_vol = (v >> 4) & 0x0F;
+            s->ch4.env_increase = (v & 0x08) != 0;
+            s->ch4.env_period = v & 7;
+            if ((v & 0xF8) == 0) { s->ch4.enabled = false; }
             break;
         case 0xFF22: // NR43 polynomial
-            A.ch4.clock_shift = (v >> 4) & 0x0F;
-            A.ch4.width_mode7 = (v & 0x08) != 0;
-            A.ch4.divisor_code = (v & 0x07);
+            s->ch4.clock_shift = (v >> 4) & 0x0F;
+            s->ch4.width_mode7 = (v & 0x08) != 0;
+            s->ch4.divisor_code = (v & 0x07);
             break;
         case 0xFF23: // NR44 trigger/length enable
-            A.ch4.length_enable = (v & 0x40) != 0;
-            if (v & 0x80) ch4_trigger();
+            s->ch4.length_enable = (v & 0x40) != 0;
+            if (v & 0x80) ch4_trigger(s);
             break;
 
         // Mixer
-        case 0xFF24: A.nr50 = v; break;
-        case 0xFF25: A.nr51 = v; break;
+        case 0xFF24: s->nr50 = v; break;
+        case 0xFF25: s->nr51 = v; break;
 
         default: break;
     }
+    mix_refresh(s, s->ticks);
+}
+
+// ---- public API ----
+void apu_init(int sample_rate) {
+    int latency_ms = A.latency_ms;
+    bool threaded = A.threaded;
+    bool muted = A.muted;
+    int rate_override = A.rate_override;
+    blip_quality quality = A.quality;
+    const char* capture_path = A.capture_path;
+    memset(&A, 0, sizeof(A));
+    A.threaded = threaded;
+    A.muted = muted;
+    A.rate_override = rate_override;
+    A.quality = quality;
+    A.capture_path = capture_path;
+    frame_ring_init(&A.ring, A.ring_frames, RING_FRAMES);
+    if (rate_override) {
+        sample_rate = rate_override;
+    }
+    A.sample_rate = sample_rate <= 0 ? 48000 : sample_rate;
+    A.base_cycles_per_sample = (double)APU_CLOCK_HZ / (double)A.sample_rate;
+    cycles_per_sample_set(A.base_cycles_per_sample);
+    apu_set_latency(latency_ms ? latency_ms : DEFAULT_LATENCY_MS);
+
+    apu_reset();
+    if (A.muted && !A.capture_path) {
+        return; // registers only, no device
+    }
+    // Threaded, the CPU side copy never synthesises.
+    blip_set_quality(A.quality);
+    synth_init(A.threaded ? &A.synth : &A.hw);
+    printf("Audio: %d Hz, %s band-limiting (%s)\n", A.sample_rate,
+        (const char*[]){"low", "medium", "high"}[A.quality], blip_impl_name());
+
+    if (A.capture_path) {
+        if (wav_capture_start(A.capture_path, A.sample_rate)) {
+            printf("Recording audio to %s\n", A.capture_path);
+        } else {
+            printf("Failed to open %s for recording\n", A.capture_path);
+        }
+    }
+    if (A.muted) {
+        return; // recording only, no device
+    }
+
+    SDL_AudioSpec want = {0}, have = {0};
+    want.freq = A.sample_rate;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = 1024; // callback chunk
+    want.callback = sdl_cb;
+    A.dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if (A.dev) SDL_PauseAudioDevice(A.dev, 0);
+}
+
+void apu_set_latency(int ms) {
+    A.latency_ms = CLAMP(ms, 1, 500);
+    if (A.sample_rate) {
+        A.target_fill = (u32)((A.sample_rate * A.latency_ms) / 1000);
+    }
+}
+
+void apu_set_threaded(bool on) {
+    A.threaded = on;
+}
+
+void apu_set_muted(bool on) {
+    A.muted = on;
+}
+
+void apu_set_sample_rate(int hz) {
+    A.rate_override = CLAMP(hz, 8000, 192000);
+}
+
+void apu_set_quality(blip_quality quality) {
+    A.quality = quality;
+}
+
+void apu_set_capture(const char* path) {
+    A.capture_path = path;
+}
+
+bool apu_playing(void) {
+    return A.dev && A.hw.power;
+}
+
+// Audio queued for the device, in ms.
+double apu_queued_ms(void) {
+    return A.sample_rate ? (frame_ring_fill(&A.ring) * 1000.0) / A.sample_rate : 0.0;
+}
+
+double apu_target_ms(void) {
+    return A.latency_ms;
+}
+
+apu_state* apu_get_state(void) {
+    return &A.hw;
+}
+
+void apu_get_stats(apu_stats* stats) {
+    stats->underruns = __atomic_load_n(&A.underruns, __ATOMIC_RELAXED);
+    stats->overruns = __atomic_load_n(&A.overruns, __ATOMIC_RELAXED);
+    stats->dropped_frames = __atomic_load_n(&A.dropped_frames, __ATOMIC_RELAXED);
+    stats->queued_frames = frame_ring_fill(&A.ring);
+    stats->capacity_frames = RING_FRAMES;
+}
+
+void apu_reset(void) {
+    state_reset(&A.hw);
+    state_reset(&A.synth);
+}
+
+void apu_start(u64 ticks) {
+    static const sched_callback callbacks[] = { apu_flush };
+    sched_register(SCHED_APU, callbacks, 1);
+    if (!A.sample_rate) return; // apu_init never ran, no audio
+    apu_state* states[] = { &A.hw, &A.synth };
+    for (int i=0; i<2; i++) {
+        states[i]->ticks = ticks;
+        states[i]->frame_start = ticks;
+        states[i]->fs_next = ticks + FS_PERIOD;
+    }
+    if (!A.hw.synth && !A.synth.synth) {
+        return; // muted, nothing to flush
+    }
+    if (A.threaded) {
+        apu_thread_start();
+    }
+    sched_add(SCHED_APU, ticks + APU_FLUSH_TICKS, apu_flush);
+}
+
+void apu_state_loaded(void) {
+    if (A.threaded && A.synth.synth) {
+        // The audio thread's copy starts over from the loaded registers.
+        apu_thread_stop();
+        memcpy(&A.synth.level, &A.hw.level, sizeof(apu_state) - offsetof(apu_state, level));
+        memcpy(&A.synth, &A.hw, offsetof(apu_state, blip_l));
+        A.synth.synth = true;
+        A.synth.ticks = A.synth.frame_start = emu_get_context()->ticks;
+        blip_clear(&A.synth.blip_l);
+        blip_clear(&A.synth.blip_r);
+        apu_thread_start();
+    }
+    if (!A.hw.synth && !A.synth.synth) {
+        sched_cancel(SCHED_APU);
+    } else if (!sched_pending(SCHED_APU)) {
+        sched_add(SCHED_APU, emu_get_context()->ticks + APU_FLUSH_TICKS, apu_flush);
+    }
+}
+
+void apu_stop(void) {
+    apu_thread_stop();
+    wav_capture_stop(); // after the last block is synthesised
+}
+
+void apu_io_write(u16 a, u8 v) {
+    apu_state* s = &A.hw;
+    apu_run(s, emu_get_context()->ticks);
+    state_write(s, a, v);
+    if (A.synth.synth) {
+        apu_queue_write(a, v);
+    }
+}
+
+// Audio thread side of the threaded mode.
+void apu_synth_write(u64 ticks, u16 a, u8 v) {
+    apu_run(&A.synth, ticks);
+    state_write(&A.synth, a, v);
+}
+
+void apu_synth_flush(u64 ticks) {
+    synth_flush(&A.synth, ticks);
 }
@@ -0,0 +1,80 @@
+#include <apu_thread.h>
+#include <apu.h>
+#include <emu.h>
+#include <sched.h>
+
+static apu_thread_context ctx = {
+    .thread = WORKER_INIT
+};
+
+apu_thread_context* apu_thread_get_context() {
+    return &ctx;
+}
+
+static apu_record* apu_queue_reserve() {
+    // The audio thread only wakes for syncs, so a full queue has to wake
+    // it before waiting for a free slot.
+    if (ctx.head - __atomic_load_n(&ctx.tail, __ATOMIC_ACQUIRE) == APU_QUEUE_SIZE) {
+        worker_wake(&ctx.thread);
+        while (ctx.head - __atomic_load_n(&ctx.tail, __ATOMIC_ACQUIRE) == APU_QUEUE_SIZE) {
+            sched_yield();
+        }
+    }
+    return &ctx.records[ctx.head & (APU_QUEUE_SIZE - 1)];
+}
+
+static void apu_queue_commit() {
+    __atomic_store_n(&ctx.head, ctx.head + 1, __ATOMIC_RELEASE);
+}
+
+void apu_queue_write(u16 address, u8 value) {
+    apu_record* r = apu_queue_reserve();
+    r->op = AQ_WRITE;
+    r->ticks = emu_get_context()->ticks;
+    r->address = address;
+    r->value = value;
+    apu_queue_commit();
+}
+
+void apu_queue_sync(u64 ticks) {
+    apu_record* r = apu_queue_reserve();
+    r->op = AQ_SYNC;
+    r->ticks = ticks;
+    apu_queue_commit();
+    worker_wake(&ctx.thread);
+}
+
+static bool apu_queue_empty() {
+    return __atomic_load_n(&ctx.head, __ATOMIC_ACQUIRE) == ctx.tail;
+}
+
+static void* apu_thread_run(void* p) {
+    while (true) {
+        u32 head = __atomic_load_n(&ctx.head, __ATOMIC_ACQUIRE);
+        if (ctx.tail == head) {
+            if (!worker_wait(&ctx.thread, apu_queue_empty)) {
+                break;
+            }
+            continue;
+        }
+        while (ctx.tail != head) {
+            apu_record* r = &ctx.records[ctx.tail & (APU_QUEUE_SIZE - 1)];
+            if (r->op == AQ_WRITE) {
+                apu_synth_write(r->ticks, r->address, r->value);
+            } else {
+                apu_synth_flush(r->ticks);
+            }
+            __atomic_store_n(&ctx.tail, ctx.tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+void apu_thread_start() {
+    ctx.head = ctx.tail = 0;
+    worker_start(&ctx.thread, apu_thread_run, "audio");
+}
+
+void apu_thread_stop() {
+    worker_stop(&ctx.thread);
+}
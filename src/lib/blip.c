@@ -0,0 +1,177 @@
+#include <blip.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLIP_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BLIP_ARM 1
+#endif
+
+#define FRAC_BITS 32
+
+typedef void (*add_fn)(int32_t* out, const int32_t* kernel, int delta);
+
+// Windowed sinc impulse per phase, normalised so every phase sums to
+// 1 << BLIP_KERNEL_BITS and a step keeps its exact height. Stored as
+// int32 so the SIMD kernels can load it directly; values fit in 16 bits.
+static int32_t kernel[BLIP_MAX_PHASES][BLIP_MAX_TAPS] __attribute__((aligned(32)));
+static int taps = 0; // 0 until a kernel is built
+static int phase_bits;
+static add_fn add_impl;
+static const char* add_name;
+
+static void add_scalar(int32_t* out, const int32_t* k, int delta) {
+    for (int i=0; i<taps; ++i) {
+        out[i] += k[i] * delta;
+    }
+}
+
+#if BLIP_X86
+// madd multiplies 16-bit pairs: the kernel's low halves against delta,
+// its sign-extension halves against zero.
+static void add_sse2(int32_t* out, const int32_t* k, int delta) {
+    __m128i d = _mm_set1_epi32(delta & 0xFFFF);
+    for (int i=0; i<taps; i+=4) {
+        __m128i p = _mm_madd_epi16(_mm_load_si128((const __m128i*)(k + i)), d);
+        __m128i o = _mm_loadu_si128((const __m128i*)(out + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi32(o, p));
+    }
+}
+
+__attribute__((target("avx2")))
+static void add_avx2(int32_t* out, const int32_t* k, int delta) {
+    __m256i d = _mm256_set1_epi32(delta);
+    for (int i=0; i<taps; i+=8) {
+        __m256i p = _mm256_mullo_epi32(_mm256_load_si256((const __m256i*)(k + i)), d);
+        __m256i o = _mm256_loadu_si256((const __m256i*)(out + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi32(o, p));
+    }
+}
+#endif
+
+#if BLIP_ARM
+static void add_neon(int32_t* out, const int32_t* k, int delta) {
+    for (int i=0; i<taps; i+=4) {
+        vst1q_s32(out + i, vmlaq_n_s32(vld1q_s32(out + i), vld1q_s32(k + i), delta));
+    }
+}
+#endif
+
+void blip_set_quality(blip_quality quality) {
+    static const int quality_taps[] = {8, 16, 32};
+    static const int quality_phase_bits[] = {5, 6, 8};
+    static const double quality_cutoff[] = {0.38, 0.45, 0.475}; // of the output rate
+    taps = quality_taps[quality];
+    phase_bits = quality_phase_bits[quality];
+    double cutoff = quality_cutoff[quality];
+    int centre = taps / 2 - 1;
+    int phases = 1 << phase_bits;
+
+    memset(kernel, 0, sizeof(kernel));
+    for (int p=0; p<phases; ++p) {
+        double frac = (double)p / phases;
+        double k[BLIP_MAX_TAPS];
+        double sum = 0;
+        for (int i=0; i<taps; ++i) {
+            double x = (i - centre) - frac;
+            double sinc = x == 0 ? 1.0 : sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+            double w = 0.5 + 0.5 * cos(M_PI * x / (taps / 2)); // Hann
+            k[i] = fabs(x) < taps / 2 ? sinc * w : 0;
+            sum += k[i];
+        }
+        int total = 0;
+        for (int i=0; i<taps; ++i) {
+            kernel[p][i] = (int32_t)lround(k[i] / sum * (1 << BLIP_KERNEL_BITS));
+            total += kernel[p][i];
+        }
+        // Put the rounding error on the centre tap.
+        kernel[p][centre] += (1 << BLIP_KERNEL_BITS) - total;
+    }
+
+    add_impl = add_scalar;
+    add_name = "scalar";
+#if BLIP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        add_impl = add_avx2;
+        add_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        add_impl = add_sse2;
+        add_name = "sse2";
+    }
+#endif
+#if BLIP_ARM
+    add_impl = add_neon;
+    add_name = "neon";
+#endif
+}
+
+const char* blip_impl_name() {
+    return add_name;
+}
+
+void blip_init(blip_buffer* b, double samples_per_clock) {
+    if (!taps) {
+        blip_set_quality(BLIP_MEDIUM);
+    }
+    memset(b, 0, sizeof(*b));
+    blip_set_rate(b, samples_per_clock);
+}
+
+void blip_set_rate(blip_buffer* b, double samples_per_clock) {
+    b->factor = (u64)(samples_per_clock * ((u64)1 << FRAC_BITS));
+}
+
+void blip_add_delta(blip_buffer* b, u32 clock, int delta) {
+    u64 pos = b->offset + (clock * b->factor);
+    u32 index = pos >> FRAC_BITS;
+    if (index >= BLIP_SIZE) {
+        return; // frame too long for the buffer
+    }
+    u32 phase = (u32)(pos >> (FRAC_BITS - phase_bits)) & ((1 << phase_bits) - 1);
+    add_impl(&b->buf[index], kernel[phase], delta);
+}
+
+void blip_end_frame(blip_buffer* b, u32 clocks) {
+    b->offset += clocks * b->factor;
+}
+
+int blip_samples_avail(const blip_buffer* b) {
+    u32 avail = b->offset >> FRAC_BITS;
+    return avail > BLIP_SIZE ? BLIP_SIZE : avail;
+}
+
+int blip_read_samples(blip_buffer* b, int16_t* out, int count, int stride) {
+    int avail = blip_samples_avail(b);
+    if (count > avail) {
+        count = avail;
+    }
+
+    int32_t sum = b->integrator;
+    for (int i=0; i<count; ++i) {
+        sum += b->buf[i];
+        int32_t s = sum >> BLIP_KERNEL_BITS;
+        out[i * stride] = s < -32768 ? -32768 : (s > 32767 ? 32767 : s);
+    }
+    b->integrator = sum;
+
+    // Keep the tails of deltas that spill past what was read.
+    memmove(b->buf, b->buf + count, (BLIP_SIZE + BLIP_MAX_TAPS - count) * sizeof(b->buf[0]));
+    memset(b->buf + BLIP_SIZE + BLIP_MAX_TAPS - count, 0, count * sizeof(b->buf[0]));
+    b->offset -= (u64)count << FRAC_BITS;
+    return count;
+}
+
+int blip_used(const blip_buffer* b, u32 clocks) {
+    u64 end = (b->offset + (u64)clocks * b->factor) >> FRAC_BITS;
+    u64 used = end + 1 + BLIP_MAX_TAPS;
+    return used > BLIP_SIZE + BLIP_MAX_TAPS ? BLIP_SIZE + BLIP_MAX_TAPS : (int)used;
+}
+
+void blip_clear(blip_buffer* b) {
+    b->offset = 0;
+    b->integrator = 0;
+    memset(b->buf, 0, sizeof(b->buf));
+}
@@ -1,32 +1,13 @@
 #include <cart.h>
+#include <emu.h>
 #include <string.h>
 
-typedef struct {
-    char filename[1024];
-    u32 rom_size;
-    u8 *rom_data;
-    rom_header *header;
-
-    //mbc1 related data
-    bool ram_enabled;
-    bool ram_banking;
-
-    u8 *rom_bank_x;
-    u8 banking_mode;
-
-    u8 rom_bank_value;
-    u8 ram_bank_value;
-
-    u8 *ram_bank; //current selected ram bank
-    u8 *ram_banks[16]; //all ram banks
-
-    //for battery
-    bool battery; //has battery
-    bool need_save; //should save battery backup.
-} cart_context;
-
 static cart_context ctx;
 
+cart_context* cart_get_context() {
+    return &ctx;
+}
+
 bool cart_need_save() {
     return ctx.need_save;
 }
@@ -182,7 +163,7 @@ void cart_battery_load() {
     }
 
     char fn[1048];
-    sprintf(fn, "%s.battery", ctx.filename);
+    sprintf(fn, "%s%s.battery", ctx.filename, ctx.save_suffix ? ctx.save_suffix : "");
     FILE *fp = fopen(fn, "rb");
 
     if (!fp) {
@@ -195,12 +176,12 @@ void cart_battery_load() {
 }
 
 void cart_battery_save() {
-    if (!ctx.ram_bank) {
+    if (!ctx.ram_bank || emu_get_context()->shadow) {
         return;
     }
 
     char fn[1048];
-    sprintf(fn, "%s.battery", ctx.filename);
+    sprintf(fn, "%s%s.battery", ctx.filename, ctx.save_suffix ? ctx.save_suffix : "");
     FILE *fp = fopen(fn, "wb");
 
     if (!fp) {
@@ -212,6 +193,10 @@ void cart_battery_save() {
     fclose(fp);
 }
 
+void cart_set_save_suffix(const char* suffix) {
+    ctx.save_suffix = suffix;
+}
+
 bool cart_load(char *cart) {
     snprintf(ctx.filename, sizeof(ctx.filename), "%s", cart);
 
@@ -0,0 +1,277 @@
+#include <compose.h>
+#include <ppu.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMPOSE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define COMPOSE_ARM 1
+#endif
+
+typedef void (*decode_fn)(const u8* planes, int rows, u8* out);
+typedef void (*merge_fn)(const u8* bg, const u8* overlay, const u8* map, u8* out, int count);
+
+static void decode_scalar(const u8* planes, int rows, u8* out);
+static void merge_scalar(const u8* bg, const u8* overlay, const u8* map, u8* out, int count);
+
+static compose_impl current = COMPOSE_SCALAR;
+static decode_fn decode_impl = decode_scalar;
+static merge_fn merge_impl = merge_scalar;
+
+static void decode_scalar(const u8* planes, int rows, u8* out) {
+    for (int r=0; r<rows; ++r) {
+        u8 lo = planes[r * 2];
+        u8 hi = planes[r * 2 + 1];
+        for (int i=0; i<8; ++i) {
+            int bit = 7 - i;
+            out[r * 8 + i] = ((lo >> bit) & 1) | (((hi >> bit) & 1) << 1);
+        }
+    }
+}
+
+static inline u8 merge_pixel(u8 bg, u8 sprite) {
+    u8 colour = sprite & OVERLAY_COLOUR;
+    if (!colour || ((sprite & OVERLAY_BGP) && bg)) {
+        return bg;
+    }
+    return colour | ((sprite & OVERLAY_PN) ? 8 : 4);
+}
+
+static void merge_scalar(const u8* bg, const u8* overlay, const u8* map, u8* out, int count) {
+    for (int i=0; i<count; ++i) {
+        u8 key = overlay ? merge_pixel(bg[i], overlay[i]) : bg[i];
+        out[i] = map[key];
+    }
+}
+
+#if COMPOSE_X86
+#define REP8(b) ((u64)(b) * 0x0101010101010101ULL)
+
+static inline __m128i sse2_decode16(u8 lo0, u8 hi0, u8 lo1, u8 hi1) {
+    const __m128i bits = _mm_setr_epi8(
+        (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+        (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    __m128i lo = _mm_set_epi64x(REP8(lo1), REP8(lo0));
+    __m128i hi = _mm_set_epi64x(REP8(hi1), REP8(hi0));
+    __m128i l = _mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits);
+    __m128i h = _mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits);
+    return _mm_or_si128(_mm_and_si128(l, _mm_set1_epi8(1)), _mm_and_si128(h, _mm_set1_epi8(2)));
+}
+
+static inline __attribute__((always_inline)) void decode_sse2(const u8* planes, int rows, u8* out) {
+    int r = 0;
+    for (; r + 2 <= rows; r += 2) {
+        __m128i v = sse2_decode16(planes[r * 2], planes[r * 2 + 1], planes[r * 2 + 2], planes[r * 2 + 3]);
+        _mm_storeu_si128((__m128i*)(out + r * 8), v);
+    }
+    if (r < rows) {
+        __m128i v = sse2_decode16(planes[r * 2], planes[r * 2 + 1], 0, 0);
+        _mm_storel_epi64((__m128i*)(out + r * 8), v);
+    }
+}
+
+static inline __m128i sse2_key(__m128i bg, __m128i ov) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i colour = _mm_and_si128(ov, _mm_set1_epi8(OVERLAY_COLOUR));
+    __m128i none = _mm_cmpeq_epi8(colour, zero);
+    __m128i bgp = _mm_cmpeq_epi8(_mm_and_si128(ov, _mm_set1_epi8((char)OVERLAY_BGP)), _mm_set1_epi8((char)OVERLAY_BGP));
+    __m128i behind = _mm_andnot_si128(_mm_cmpeq_epi8(bg, zero), bgp);
+    __m128i keep_bg = _mm_or_si128(none, behind);
+    __m128i pn = _mm_cmpeq_epi8(_mm_and_si128(ov, _mm_set1_epi8(OVERLAY_PN)), _mm_set1_epi8(OVERLAY_PN));
+    __m128i pal = _mm_xor_si128(_mm_set1_epi8(4), _mm_and_si128(pn, _mm_set1_epi8(12)));
+    __m128i sprite = _mm_or_si128(colour, pal);
+    return _mm_or_si128(_mm_and_si128(keep_bg, bg), _mm_andnot_si128(keep_bg, sprite));
+}
+
+static inline __m128i sse2_map(__m128i key, const u8* map) {
+    // No byte shuffle in SSE2, select each of the 12 entries instead.
+    __m128i out = _mm_setzero_si128();
+    for (int k=0; k<12; ++k) {
+        __m128i hit = _mm_cmpeq_epi8(key, _mm_set1_epi8(k));
+        out = _mm_or_si128(out, _mm_and_si128(hit, _mm_set1_epi8(map[k])));
+    }
+    return out;
+}
+
+static inline __attribute__((always_inline)) void merge_sse2(const u8* bg, const u8* overlay, const u8* map, u8* out, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i key = _mm_loadu_si128((const __m128i*)(bg + i));
+        if (overlay) {
+            key = sse2_key(key, _mm_loadu_si128((const __m128i*)(overlay + i)));
+        }
+        _mm_storeu_si128((__m128i*)(out + i), sse2_map(key, map));
+    }
+    // Below 16 pixels (the FIFO's fetches) the 12 selects lose to scalar.
+    merge_scalar(bg + i, overlay ? overlay + i : NULL, map, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void decode_avx2(const u8* planes, int rows, u8* out) {
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080LL);
+    int r = 0;
+    for (; r + 4 <= rows; r += 4) {
+        const u8* p = planes + r * 2;
+        __m256i lo = _mm256_set_epi64x(REP8(p[6]), REP8(p[4]), REP8(p[2]), REP8(p[0]));
+        __m256i hi = _mm256_set_epi64x(REP8(p[7]), REP8(p[5]), REP8(p[3]), REP8(p[1]));
+        __m256i l = _mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits);
+        __m256i h = _mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits);
+        __m256i v = _mm256_or_si256(_mm256_and_si256(l, _mm256_set1_epi8(1)), _mm256_and_si256(h, _mm256_set1_epi8(2)));
+        _mm256_storeu_si256((__m256i*)(out + r * 8), v);
+    }
+    decode_sse2(planes + r * 2, rows - r, out + r * 8);
+}
+
+__attribute__((target("avx2")))
+static void merge_avx2(const u8* bg, const u8* overlay, const u8* map, u8* out, int count) {
+    __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)map));
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i key = _mm256_loadu_si256((const __m256i*)(bg + i));
+        if (overlay) {
+            __m256i ov = _mm256_loadu_si256((const __m256i*)(overlay + i));
+            __m256i colour = _mm256_and_si256(ov, _mm256_set1_epi8(OVERLAY_COLOUR));
+            __m256i none = _mm256_cmpeq_epi8(colour, zero);
+            __m256i bgp = _mm256_cmpeq_epi8(_mm256_and_si256(ov, _mm256_set1_epi8((char)OVERLAY_BGP)), _mm256_set1_epi8((char)OVERLAY_BGP));
+            __m256i behind = _mm256_andnot_si256(_mm256_cmpeq_epi8(key, zero), bgp);
+            __m256i keep_bg = _mm256_or_si256(none, behind);
+            __m256i pn = _mm256_cmpeq_epi8(_mm256_and_si256(ov, _mm256_set1_epi8(OVERLAY_PN)), _mm256_set1_epi8(OVERLAY_PN));
+            __m256i pal = _mm256_xor_si256(_mm256_set1_epi8(4), _mm256_and_si256(pn, _mm256_set1_epi8(12)));
+            key = _mm256_blendv_epi8(_mm256_or_si256(colour, pal), key, keep_bg);
+        }
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_shuffle_epi8(table, key));
+    }
+    // The rest, and the FIFO's 8 pixel fetches, in 16 and 8 byte halves.
+    __m128i half = _mm256_castsi256_si128(table);
+    for (; i + 16 <= count; i += 16) {
+        __m128i key = _mm_loadu_si128((const __m128i*)(bg + i));
+        if (overlay) {
+            key = sse2_key(key, _mm_loadu_si128((const __m128i*)(overlay + i)));
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_shuffle_epi8(half, key));
+    }
+    if (i + 8 <= count) {
+        __m128i key = _mm_loadl_epi64((const __m128i*)(bg + i));
+        if (overlay) {
+            key = sse2_key(key, _mm_loadl_epi64((const __m128i*)(overlay + i)));
+        }
+        _mm_storel_epi64((__m128i*)(out + i), _mm_shuffle_epi8(half, key));
+        i += 8;
+    }
+    merge_scalar(bg + i, overlay ? overlay + i : NULL, map, out + i, count - i);
+}
+#endif
+
+#if COMPOSE_ARM
+static void decode_neon(const u8* planes, int rows, u8* out) {
+    static const u8 bit_table[16] = {
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+    uint8x16_t bits = vld1q_u8(bit_table);
+    int r = 0;
+    for (; r + 2 <= rows; r += 2) {
+        const u8* p = planes + r * 2;
+        uint8x16_t lo = vcombine_u8(vdup_n_u8(p[0]), vdup_n_u8(p[2]));
+        uint8x16_t hi = vcombine_u8(vdup_n_u8(p[1]), vdup_n_u8(p[3]));
+        uint8x16_t l = vandq_u8(vtstq_u8(lo, bits), vdupq_n_u8(1));
+        uint8x16_t h = vandq_u8(vtstq_u8(hi, bits), vdupq_n_u8(2));
+        vst1q_u8(out + r * 8, vorrq_u8(l, h));
+    }
+    decode_scalar(planes + r * 2, rows - r, out + r * 8);
+}
+
+static void merge_neon(const u8* bg, const u8* overlay, const u8* map, u8* out, int count) {
+    uint8x16_t table = vld1q_u8(map);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t key = vld1q_u8(bg + i);
+        if (overlay) {
+            uint8x16_t ov = vld1q_u8(overlay + i);
+            uint8x16_t colour = vandq_u8(ov, vdupq_n_u8(OVERLAY_COLOUR));
+            uint8x16_t none = vceqq_u8(colour, vdupq_n_u8(0));
+            uint8x16_t behind = vandq_u8(vtstq_u8(ov, vdupq_n_u8(OVERLAY_BGP)), vtstq_u8(key, key));
+            uint8x16_t keep_bg = vorrq_u8(none, behind);
+            uint8x16_t pn = vtstq_u8(ov, vdupq_n_u8(OVERLAY_PN));
+            uint8x16_t pal = veorq_u8(vdupq_n_u8(4), vandq_u8(pn, vdupq_n_u8(12)));
+            key = vbslq_u8(keep_bg, key, vorrq_u8(colour, pal));
+        }
+        vst1q_u8(out + i, vqtbl1q_u8(table, key));
+    }
+    merge_scalar(bg + i, overlay ? overlay + i : NULL, map, out + i, count - i);
+}
+#endif
+
+bool compose_supported(compose_impl impl) {
+    switch (impl) {
+        case COMPOSE_SCALAR:
+            return true;
+#if COMPOSE_X86
+        case COMPOSE_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case COMPOSE_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#if COMPOSE_ARM
+        case COMPOSE_NEON:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool compose_select(compose_impl impl) {
+    if (!compose_supported(impl)) {
+        return false;
+    }
+
+    switch (impl) {
+#if COMPOSE_X86
+        case COMPOSE_SSE2:
+            decode_impl = decode_sse2;
+            merge_impl = merge_sse2;
+            break;
+        case COMPOSE_AVX2:
+            decode_impl = decode_avx2;
+            merge_impl = merge_avx2;
+            break;
+#endif
+#if COMPOSE_ARM
+        case COMPOSE_NEON:
+            decode_impl = decode_neon;
+            merge_impl = merge_neon;
+            break;
+#endif
+        default:
+            decode_impl = decode_scalar;
+            merge_impl = merge_scalar;
+            break;
+    }
+    current = impl;
+    return true;
+}
+
+void compose_init() {
+    if (!compose_select(COMPOSE_AVX2) && !compose_select(COMPOSE_SSE2) && !compose_select(COMPOSE_NEON)) {
+        compose_select(COMPOSE_SCALAR);
+    }
+}
+
+compose_impl compose_current() {
+    return current;
+}
+
+const char* compose_name(compose_impl impl) {
+    static const char* names[] = {"scalar", "sse2", "avx2", "neon"};
+    return names[impl];
+}
+
+void compose_decode(const u8* planes, int rows, u8* out) {
+    decode_impl(planes, rows, out);
+}
+
+void compose_merge(const u8* bg, const u8* overlay, const u8* map, u8* out, int count) {
+    merge_impl(bg, overlay, map, out, count);
+}
@@ -9,6 +9,10 @@
 
 cpu_context ctx = {0};
 
+cpu_context* cpu_get_context() {
+    return &ctx;
+}
+
 #define CPU_DEBUG 0
 
 void cpu_init() {
@@ -29,7 +33,7 @@ void cpu_init() {
         ctx.int_flags = 0;
         ctx.int_master_enabled = false;
         ctx.enabling_ime = false;
-        timer_get_context()->div = 0xABCC;
+        timer_set_div(0xABCC);
     }
 }
 
@@ -82,7 +86,6 @@ bool cpu_step() {
             printf("Unknown Instruction! %02X\n", ctx.curr_opcode);
             exit(-7);
         }
-        dbg_update();
         dbg_print();
 #endif
         execute();
@@ -4,11 +4,9 @@
 static char dbg_msg[1024] = {0};
 static int msg_size = 0;
 
-void dbg_update() {
-    if (bus_read(0xFF02) == 0x81) {
-        char c = bus_read(0xFF01);
+void dbg_serial(u8 c) {
+    if (msg_size < (int)sizeof(dbg_msg) - 1) {
         dbg_msg[msg_size++] = c;
-        bus_write(0xFF02, 0x00);
     }
 }
 
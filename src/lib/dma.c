@@ -6,6 +6,10 @@
 
 static dma_context ctx;
 
+dma_context* dma_get_context() {
+    return &ctx;
+}
+
 void dma_start(u8 start) {
     ctx.active = true;
     ctx.byte = 0;
@@ -4,13 +4,21 @@
 #include <ui.h>
 #include <cpu.h>
 #include <pthread.h>
-#include <unistd.h>
 #include <timer.h>
 #include <ui.h>
 #include <dma.h>
 #include <ppu.h>
 #include <bootrom.h>
 #include <apu.h>
+#include <serial.h>
+#include <link.h>
+#include <rollback.h>
+#include <state.h>
+#include <scheduler.h>
+#include <palette.h>
+#include <ppu_thread.h>
+#include <pacer.h>
+#include <string.h>
 
 static emu_context ctx;
 
@@ -18,18 +26,49 @@ emu_context* emu_get_context() {
     return &ctx;
 }
 
+// Quick save file, the ROM's path with .state appended by default.
+static char state_path[1024];
+
+static void emu_state_requests() {
+    if (ctx.save_state) {
+        ctx.save_state = false;
+        bool ok = state_save_file(state_path);
+        printf(ok ? "Saved state to %s\n" : "Failed to save state to %s\n", state_path);
+    }
+    if (ctx.load_state) {
+        ctx.load_state = false;
+        if (state_load_file(state_path)) {
+            pacer_init(ctx.ticks);
+            printf("Loaded state from %s\n", state_path);
+        } else {
+            printf("No state for this ROM in %s\n", state_path);
+        }
+    }
+}
+
 void* cpu_run(void* p) {
+    ctx.ticks = 0;
+    sched_init();
     timer_init();
+    serial_init();
     cpu_init();
     ppu_init();
+    apu_start(ctx.ticks);
+    pacer_init(ctx.ticks);
     ctx.running = true;
     ctx.paused = false;
-    ctx.ticks = 0;
+    if (rollback_active()) {
+        rollback_run();
+        return NULL;
+    }
     while (ctx.running) {
         if (ctx.paused) {
             delay(10);
             continue;
         }
+        if (ctx.save_state || ctx.load_state) {
+            emu_state_requests();
+        }
         if (!cpu_step()) {
             printf("CPU step failed\n");
             return (void *)-3;
@@ -38,36 +77,211 @@ void* cpu_run(void* p) {
     return NULL;
 }
 
+#define PRESENT_TIMEOUT_MS 16
+
+// Second instance on a link cable, see link.h.
+static bool link_enabled;
+static char* link_rom;
+
+// Player 2 adds this to the files it writes, so the two instances don't
+// write over each other's state, recording or, on the same ROM, battery.
+#define LINK_P2_SUFFIX ".p2"
+
+// --record-audio file, passed on once the link player is known.
+static char* record_path;
+static char record_file[1024];
+
+// Rollback link play with another process, see rollback.h.
+static char* rollback_addr;
+static bool rollback_host;
+
+static void emu_usage(char* prog) {
+    printf("Usage: %s [options] <rom.gb> [bootrom.bin]\n", prog);
+    printf("  --indexed            keep the framebuffer as palette indices\n");
+    printf("  --palette=grey|green palette used when presenting frames\n");
+    printf("  --renderer=fifo|scanline|thread|parallel\n");
+    printf("                       per-dot pixel FIFO, whole-line renderer, lines\n");
+    printf("                       drawn on a separate thread, or whole frames\n");
+    printf("                       drawn at VBlank on a worker pool\n");
+    printf("  --speed=X|turbo      run at X times real time, or unlimited\n");
+    printf("  --audio-latency=MS   audio queue length rate control aims for (40)\n");
+    printf("  --audio-rate=HZ      audio output rate (48000)\n");
+    printf("  --audio-quality=low|medium|high\n");
+    printf("                       band-limiting kernel length, 8, 16 or 32 taps\n");
+    printf("  --audio-thread       synthesise audio on a separate thread\n");
+    printf("  --no-audio           keep sound registers working but output nothing\n");
+    printf("  --record-audio=FILE  write the audio output to a WAV file\n");
+    printf("  --sync=audio         pace emulation on the audio device clock\n");
+    printf("  --vsync              present in step with the display refresh\n");
+    printf("  --frameskip=N        draw 1 of every N frames\n");
+    printf("  --frameskip=request  draw only frames the presenter asks for\n");
+    printf("  --link[=ROM]         start a second instance on a link cable, with ROM if given\n");
+    printf("  --rollback-host=ADDR wait for player 2 to link up over a Unix socket\n");
+    printf("                       path or a loopback TCP port\n");
+    printf("  --rollback-join=ADDR link up as player 2 with the host at ADDR\n");
+    printf("  --state=FILE         quick save file for F5 (save) and F8 (load)\n");
+}
+
+static bool emu_option(char* arg) {
+    if (!strcmp(arg, "--indexed")) {
+        ppu_get_context()->indexed = true;
+    } else if (!strcmp(arg, "--palette=grey")) {
+        palette_select(PALETTE_GREY);
+    } else if (!strcmp(arg, "--palette=green")) {
+        palette_select(PALETTE_GREEN);
+    } else if (!strcmp(arg, "--renderer=fifo")) {
+        ppu_get_context()->renderer = RENDER_FIFO;
+    } else if (!strcmp(arg, "--renderer=scanline")) {
+        ppu_get_context()->renderer = RENDER_SCANLINE;
+    } else if (!strcmp(arg, "--renderer=thread")) {
+        ppu_get_context()->renderer = RENDER_THREAD;
+    } else if (!strcmp(arg, "--renderer=parallel")) {
+        ppu_get_context()->renderer = RENDER_PARALLEL;
+    } else if (!strcmp(arg, "--speed=turbo")) {
+        pacer_set_speed(PACER_TURBO);
+    } else if (!strncmp(arg, "--speed=", 8) && atof(arg + 8) > 0) {
+        pacer_set_speed(atof(arg + 8));
+    } else if (!strncmp(arg, "--audio-latency=", 16) && atoi(arg + 16) > 0) {
+        apu_set_latency(atoi(arg + 16));
+    } else if (!strncmp(arg, "--audio-rate=", 13) && atoi(arg + 13) > 0) {
+        apu_set_sample_rate(atoi(arg + 13));
+    } else if (!strcmp(arg, "--audio-quality=low")) {
+        apu_set_quality(BLIP_LOW);
+    } else if (!strcmp(arg, "--audio-quality=medium")) {
+        apu_set_quality(BLIP_MEDIUM);
+    } else if (!strcmp(arg, "--audio-quality=high")) {
+        apu_set_quality(BLIP_HIGH);
+    } else if (!strncmp(arg, "--record-audio=", 15) && arg[15]) {
+        record_path = arg + 15;
+    } else if (!strcmp(arg, "--no-audio")) {
+        apu_set_muted(true);
+    } else if (!strcmp(arg, "--audio-thread")) {
+        apu_set_threaded(true);
+    } else if (!strcmp(arg, "--sync=audio")) {
+        pacer_set_audio_sync(true);
+    } else if (!strcmp(arg, "--vsync")) {
+        ui_set_vsync(true);
+    } else if (!strcmp(arg, "--frameskip=request")) {
+        ppu_get_context()->render_on_request = true;
+    } else if (!strncmp(arg, "--frameskip=", 12) && atoi(arg + 12) > 0) {
+        ppu_get_context()->frame_skip = atoi(arg + 12);
+    } else if (!strcmp(arg, "--link")) {
+        link_enabled = true;
+    } else if (!strncmp(arg, "--link=", 7) && arg[7]) {
+        link_enabled = true;
+        link_rom = arg + 7;
+    } else if (!strncmp(arg, "--rollback-host=", 16) && arg[16]) {
+        rollback_addr = arg + 16;
+        rollback_host = true;
+    } else if (!strncmp(arg, "--rollback-join=", 16) && arg[16]) {
+        rollback_addr = arg + 16;
+        rollback_host = false;
+    } else if (!strncmp(arg, "--state=", 8) && arg[8]) {
+        snprintf(state_path, sizeof(state_path), "%s", arg + 8);
+    } else {
+        return false;
+    }
+    return true;
+}
+
 int emu_run(int argc, char** argv) {
-    if (argc < 2) {
-        printf("Usage: %s <rom.gb> [bootrom.bin]\n", argv[0]);
+    char* rom = NULL;
+    char* boot = NULL;
+    for (int i=1; i<argc; ++i) {
+        if (!strncmp(argv[i], "--", 2)) {
+            if (!emu_option(argv[i])) {
+                printf("Unknown option: %s\n", argv[i]);
+                emu_usage(argv[0]);
+                return -1;
+            }
+        } else if (!rom) {
+            rom = argv[i];
+        } else if (!boot) {
+            boot = argv[i];
+        }
+    }
+    if (!rom) {
+        emu_usage(argv[0]);
+        return -1;
+    }
+    if (link_enabled && rollback_addr) {
+        printf("--link and --rollback-host/join can't be combined\n");
         return -1;
     }
+    const char* suffix = "";
+    if (link_enabled) {
+        int player = link_fork();
+        if (player < 0) {
+            fprintf(stderr, "Failed to start the linked instance\n");
+            return -3;
+        }
+        if (player == 1) {
+            suffix = LINK_P2_SUFFIX;
+            if (link_rom) {
+                rom = link_rom;
+            } else {
+                cart_set_save_suffix(suffix);
+            }
+        }
+        printf("Link cable: player %d\n", player + 1);
+    }
+    if (!state_path[0]) {
+        snprintf(state_path, sizeof(state_path), "%s%s.state", rom, link_rom ? "" : suffix);
+    } else {
+        size_t len = strlen(state_path);
+        snprintf(state_path + len, sizeof(state_path) - len, "%s", suffix);
+    }
+    if (record_path) {
+        snprintf(record_file, sizeof(record_file), "%s%s", record_path, suffix);
+        apu_set_capture(record_file);
+    }
     // Optional 2nd arg: path to boot ROM
-    if (argc >= 3 && bootrom_load(argv[2])) {
-        printf("Loaded boot ROM: %s\n", argv[2]);
+    if (boot && bootrom_load(boot)) {
+        printf("Loaded boot ROM: %s\n", boot);
     }
     bootrom_reset();
-    if (!cart_load(argv[1])) {
-        printf("Failed to load ROM file: %s\n", argv[1]);
+    if (!cart_load(rom)) {
+        printf("Failed to load ROM file: %s\n", rom);
         return -2;
     }
-    printf("Successfully loaded ROM file: %s\n", argv[1]);
+    printf("Successfully loaded ROM file: %s\n", rom);
+    if (rollback_addr) {
+        // Machines are switched and rewound by copying their state, which
+        // only covers the whole-line renderer and unthreaded sound.
+        ppu_get_context()->renderer = RENDER_SCANLINE;
+        apu_set_threaded(false);
+        if (!rollback_connect(rollback_addr, rollback_host)) {
+            return -3;
+        }
+    }
     ui_init();
     pthread_t t1;
     if(pthread_create(&t1, NULL, cpu_run, NULL) != 0) {
         fprintf(stderr, "Failed to create CPU thread\n");
         return -3;
     }
-    u32 prev_frame = 0;
+    if (ppu_get_context()->render_on_request) {
+        ppu_request_frame();
+    }
     while(!ctx.die) {
-        usleep(1000);
+        // Sleep until the PPU publishes a frame. The timeout keeps input
+        // and the debug window going while the LCD is off or frames are
+        // skipped.
+        bool frame = ppu_wait_frame(PRESENT_TIMEOUT_MS);
         ui_handle_events();
-        if (prev_frame != ppu_get_context()->current_frame) {
-            ui_update();
+        ui_update();
+        if (frame && ppu_get_context()->render_on_request) {
+            ppu_request_frame();
         }
-        prev_frame = ppu_get_context()->current_frame;
     }
+    // Let the emulation thread finish its step before stopping what it
+    // feeds.
+    ctx.running = false;
+    link_close(); // wakes a transfer waiting on the peer
+    pthread_join(t1, NULL);
+    render_thread_stop();
+    apu_stop();
+    link_join();
     return 0;
 }
 
@@ -75,9 +289,10 @@ void emu_cycles(int cpu_cycles) {
     for (int i =0; i<cpu_cycles; ++i) {
         for (int n=0; n<4; ++n) {
             ctx.ticks ++;
-            timer_tick();
             ppu_tick();
-            apu_tick();
+            if (ctx.ticks >= sched_get_context()->next) {
+                sched_run(ctx.ticks);
+            }
         }
         dma_tick();
     }
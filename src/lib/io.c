@@ -6,8 +6,7 @@
 #include <joypad.h>
 #include <bootrom.h>
 #include <apu.h>
-
-static char serial_data[2];
+#include <serial.h>
 
 u8 ly = 0;
 
@@ -21,11 +20,8 @@ u8 io_read(u16 address) {
     if (address == 0xFF00) {
         return joypad_get_output();
     }
-    if (address == 0xFF01) {
-        return serial_data[0];
-    }
-    if (address == 0xFF02) {
-        return serial_data[1];
+    if (address == 0xFF01 || address == 0xFF02) {
+        return serial_read(address);
     }
     if (BETWEEN(address, 0xFF04, 0xFF07)) {
         return timer_read(address);
@@ -57,11 +53,9 @@ void io_write(u16 address, u8 value) {
         joypad_set_sel(value);
         return;
     }
-    if (address == 0xFF01) {
-        serial_data[0] = value;
-    }
-    if (address == 0xFF02) {
-        serial_data[1] = value;
+    if (address == 0xFF01 || address == 0xFF02) {
+        serial_write(address, value);
+        return;
     }
     if (BETWEEN(address, 0xFF04, 0xFF07)) {
         timer_write(address, value);
@@ -1,14 +1,13 @@
 #include <joypad.h>
 #include <string.h>
 
-typedef struct {
-    bool button_sel;
-    bool dir_sel;
-    joypad_state controller;
-} joypad_context;
-
 static joypad_context ctx = {0};
 
+// What the player is pressing, written by the UI. The machine reads it
+// directly unless inputs are fed to it frame by frame.
+static joypad_state pad;
+static bool fed;
+
 void joypad_init() {
 
 }
@@ -26,31 +25,57 @@ void joypad_set_sel(u8 value) {
     ctx.dir_sel = value & 0x10;
 }
 
+joypad_context* joypad_get_context() {
+    return &ctx;
+}
+
 joypad_state* joypad_get_state() {
-    return &ctx.controller;
+    return &pad;
+}
+
+void joypad_feed(u8 buttons) {
+    fed = true;
+    ctx.controller = (joypad_state){
+        .a = buttons & JOYPAD_A,
+        .b = buttons & JOYPAD_B,
+        .select = buttons & JOYPAD_SELECT,
+        .start = buttons & JOYPAD_START,
+        .right = buttons & JOYPAD_RIGHT,
+        .left = buttons & JOYPAD_LEFT,
+        .up = buttons & JOYPAD_UP,
+        .down = buttons & JOYPAD_DOWN,
+    };
+}
+
+u8 joypad_buttons() {
+    return (pad.a ? JOYPAD_A : 0) | (pad.b ? JOYPAD_B : 0) |
+        (pad.select ? JOYPAD_SELECT : 0) | (pad.start ? JOYPAD_START : 0) |
+        (pad.right ? JOYPAD_RIGHT : 0) | (pad.left ? JOYPAD_LEFT : 0) |
+        (pad.up ? JOYPAD_UP : 0) | (pad.down ? JOYPAD_DOWN : 0);
 }
 
 u8 joypad_get_output() {
+    const joypad_state* in = fed ? &ctx.controller : &pad;
     u8 output = 0xCF;
     if (!joypad_button_sel()) {
-        if(joypad_get_state()->start) {
+        if(in->start) {
             output &= ~(1<<3);
-        } else if(joypad_get_state()->select) {
+        } else if(in->select) {
             output &= ~(1<<2);
-        } else if(joypad_get_state()->a) {
+        } else if(in->a) {
             output &= ~(1<<0);
-        } else if(joypad_get_state()->b) {
+        } else if(in->b) {
             output &= ~(1<<1);
         }
     }
     if (!joypad_dir_sel()) {
-        if(joypad_get_state()->left) {
+        if(in->left) {
             output &= ~(1<<1);
-        } else if(joypad_get_state()->right) {
+        } else if(in->right) {
             output &= ~(1<<0);
-        } else if(joypad_get_state()->up) {
+        } else if(in->up) {
             output &= ~(1<<2);
-        } else if(joypad_get_state()->down) {
+        } else if(in->down) {
             output &= ~(1<<3);
         }
     }
@@ -2,12 +2,12 @@
 #include <common.h>
 #include <ppu.h>
 #include <dma.h>
+#include <ppu_sm.h>
+#include <palette.h>
 
 
 static lcd_context ctx = {0};
 
-static unsigned long colours_default[4] = {0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000};
-
 void lcd_init() {
     ctx.lcdc = 0x91;
     ctx.sc_x = 0;
@@ -21,9 +21,9 @@ void lcd_init() {
     ctx.win_y = 0;
     int i;
     for (i=0;i<4;++i) {
-        ctx.bg_colours[i] = colours_default[i];
-        ctx.sp1_colours[i] = colours_default[i];
-        ctx.sp2_colours[i] = colours_default[i];
+        ctx.pixel_map[i | (PAL_BG << 2)] = PIXEL_PACK(i, PAL_BG);
+        ctx.pixel_map[i | (PAL_OBP0 << 2)] = PIXEL_PACK(i, PAL_OBP0);
+        ctx.pixel_map[i | (PAL_OBP1 << 2)] = PIXEL_PACK(i, PAL_OBP1);
     }
 }
 
@@ -38,27 +38,29 @@ u8 lcd_read(u16 address) {
 }
 
 void update_palette(u8 palette_data, u8 pal) {
-    u32* p_colours = ctx.bg_colours;
-    switch (pal) {
-        case 1:
-        p_colours = ctx.sp1_colours;
-        break;
-        case 2:
-        p_colours = ctx.sp2_colours;
-        break;
-    }
+    u8* p_map = &ctx.pixel_map[pal << 2];
 
-    p_colours[0] = colours_default[palette_data & 0x11];
-    p_colours[1] = colours_default[(palette_data >> 2) & 0b11];
-    p_colours[2] = colours_default[(palette_data >> 4) & 0b11];
-    p_colours[3] = colours_default[(palette_data >> 6) & 0b11];
+    p_map[0] = PIXEL_PACK(palette_data & 0b11, pal);
+    p_map[1] = PIXEL_PACK((palette_data >> 2) & 0b11, pal);
+    p_map[2] = PIXEL_PACK((palette_data >> 4) & 0b11, pal);
+    p_map[3] = PIXEL_PACK((palette_data >> 6) & 0b11, pal);
 }
 
 void lcd_write(u16 address, u8 value) {
     u8 offset = (address - 0xFF40);
     u8* p = (u8*)&ctx;
+    u8 prev_lcdc = ctx.lcdc;
+
+    if (address == 0xFF41) {
+        // Mode and LYC flag bits are owned by the PPU.
+        value = (value & ~0b111) | (ctx.lcds & 0b111);
+    }
     p[offset] = value;
 
+    if (address == 0xFF40 && ((prev_lcdc ^ value) & 0x80)) {
+        ppu_lcd_enable(value & 0x80);
+    }
+
     if (offset == 6) {
         //0xFF46 = DMA
         dma_start(value);
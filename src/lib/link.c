@@ -0,0 +1,291 @@
+#include <link.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef struct {
+    u64 ticks;    // published emulation tick
+    bool waiting; // blocked in link_transfer
+    bool armed;   // external clock transfer waiting for the peer
+    bool has_in;  // in holds a byte from the peer
+    u8 in;
+    u64 in_ticks; // tick the peer's transfer ended on
+} link_side;
+
+// Lives in shared memory, mapped before the fork.
+typedef struct {
+    pthread_mutex_t lock; // robust: a peer dying while holding it closes the link
+    pthread_cond_t cond;  // broadcast on every change a waiter checks
+    bool closed;
+    link_side side[2];
+} link_shared;
+
+// Waits wake up this often to check the peer process is still there.
+#define LINK_ALIVE_MS 100
+
+static link_shared* shared;
+static int self;
+static bool paired;
+static link_pair_state pair;
+static pid_t peer_pid;   // the child in the parent, the parent in the child
+static bool peer_reaped;
+
+int link_fork() {
+    shared = mmap(NULL, sizeof(link_shared), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        shared = NULL;
+        return -1;
+    }
+
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &ma);
+    pthread_mutexattr_destroy(&ma);
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&shared->cond, &ca);
+    pthread_condattr_destroy(&ca);
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        munmap(shared, sizeof(link_shared));
+        shared = NULL;
+        return -1;
+    }
+    self = pid == 0 ? 1 : 0;
+    peer_pid = pid == 0 ? parent : pid;
+    return self;
+}
+
+void link_pair() {
+    paired = true;
+    self = 0;
+}
+
+void link_select(int side) {
+    self = side;
+}
+
+link_pair_state* link_pair_get_state() {
+    return &pair;
+}
+
+bool link_connected() {
+    if (paired) {
+        return true;
+    }
+    return shared && !__atomic_load_n(&shared->closed, __ATOMIC_ACQUIRE);
+}
+
+// A peer that died holding the lock leaves it for us to recover, and
+// the link closed.
+static void link_lock_result(int err) {
+    if (err == EOWNERDEAD) {
+        pthread_mutex_consistent(&shared->lock);
+        __atomic_store_n(&shared->closed, true, __ATOMIC_RELEASE);
+    }
+}
+
+static void link_lock() {
+    link_lock_result(pthread_mutex_lock(&shared->lock));
+}
+
+static bool link_peer_alive() {
+    if (self == 1) {
+        return getppid() == peer_pid; // reparented once the parent is gone
+    }
+    // A dead child stays a zombie, which kill(pid, 0) still finds.
+    if (!peer_reaped && waitpid(peer_pid, NULL, WNOHANG) == peer_pid) {
+        peer_reaped = true;
+    }
+    return !peer_reaped;
+}
+
+// Waits on cond with the lock held. A peer that crashes or is killed
+// never closes the link itself, so check it is still there every
+// LINK_ALIVE_MS.
+static void link_wait() {
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_nsec += LINK_ALIVE_MS * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    int err = pthread_cond_timedwait(&shared->cond, &shared->lock, &until);
+    link_lock_result(err);
+    if (err == ETIMEDOUT && !link_peer_alive()) {
+        __atomic_store_n(&shared->closed, true, __ATOMIC_RELEASE);
+    }
+}
+
+static void link_wake() {
+    link_lock();
+    pthread_cond_broadcast(&shared->cond);
+    pthread_mutex_unlock(&shared->lock);
+}
+
+void link_close() {
+    if (!shared) {
+        return;
+    }
+    __atomic_store_n(&shared->closed, true, __ATOMIC_RELEASE);
+    link_wake();
+}
+
+void link_join() {
+    if (shared && self == 0 && !peer_reaped) {
+        waitpid(peer_pid, NULL, 0);
+        peer_reaped = true;
+    }
+}
+
+void link_sync(u64 ticks) {
+    if (!shared) { // in pair mode the machines' turns keep them in step
+        return;
+    }
+    __atomic_store_n(&shared->side[self].ticks, ticks, __ATOMIC_RELEASE);
+    // Only take the lock when the peer is waiting on our time.
+    if (__atomic_load_n(&shared->side[!self].waiting, __ATOMIC_ACQUIRE)) {
+        link_wake();
+    }
+}
+
+static u8 link_pair_transfer(u8 out, u64 ticks) {
+    link_pair_side* peer = &pair.side[!self];
+    if (!peer->armed) {
+        return 0xFF;
+    }
+    peer->armed = false;
+    peer->has_in = true;
+    peer->in = out;
+    peer->in_ticks = ticks;
+    return peer->sb;
+}
+
+u8 link_transfer(u8 out, u64 ticks) {
+    if (paired) {
+        return link_pair_transfer(out, ticks);
+    }
+    if (!link_connected()) {
+        return 0xFF;
+    }
+    link_side* me = &shared->side[self];
+    link_side* peer = &shared->side[!self];
+    bool posted = false;
+    u8 in = 0xFF;
+
+    link_lock();
+    __atomic_store_n(&me->ticks, ticks, __ATOMIC_RELEASE);
+    __atomic_store_n(&me->waiting, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&shared->cond); // the peer may wait on our time
+    while (!shared->closed) {
+        if (!posted && peer->armed) {
+            peer->in = out;
+            peer->in_ticks = ticks;
+            __atomic_store_n(&peer->has_in, true, __ATOMIC_RELEASE);
+            posted = true;
+            pthread_cond_broadcast(&shared->cond);
+        }
+        if (posted) {
+            if (me->has_in) {
+                in = me->in;
+                me->has_in = false;
+                break;
+            }
+            if (!peer->has_in) {
+                break; // disarmed, byte dropped
+            }
+        } else if (__atomic_load_n(&peer->ticks, __ATOMIC_ACQUIRE) >= ticks) {
+            break; // ran past this transfer without arming
+        }
+        link_wait();
+    }
+    if (posted) {
+        __atomic_store_n(&peer->has_in, false, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&me->waiting, false, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shared->lock);
+    return in;
+}
+
+void link_arm(bool armed, u8 sb) {
+    if (paired) {
+        pair.side[self].armed = armed;
+        pair.side[self].sb = sb;
+        if (!armed) {
+            pair.side[self].has_in = false;
+        }
+        return;
+    }
+    if (!shared) {
+        return;
+    }
+    link_lock();
+    shared->side[self].armed = armed;
+    if (!armed) {
+        __atomic_store_n(&shared->side[self].has_in, false, __ATOMIC_RELEASE);
+    }
+    pthread_cond_broadcast(&shared->cond);
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// An armed external clock side stays level with the peer, so its
+// transfer ends at its first poll from the peer's end tick on.
+static bool link_ahead(u64 ticks) {
+    return ticks > __atomic_load_n(&shared->side[!self].ticks, __ATOMIC_ACQUIRE);
+}
+
+// Peer's byte is in and its transfer has ended by ticks.
+static bool link_ready(link_side* me, u64 ticks) {
+    return __atomic_load_n(&me->has_in, __ATOMIC_ACQUIRE) && ticks >= me->in_ticks;
+}
+
+bool link_poll(u8 out, u8* in, u64 ticks) {
+    if (paired) {
+        link_pair_side* me = &pair.side[self];
+        if (!me->has_in || ticks < me->in_ticks) {
+            return false;
+        }
+        me->has_in = false;
+        *in = me->in;
+        return true;
+    }
+    if (!shared) {
+        return false;
+    }
+    link_side* me = &shared->side[self];
+    // Only the peer sets has_in, so an unlocked peek is enough to skip the
+    // lock on the common empty poll.
+    if (!link_ready(me, ticks) && !link_ahead(ticks)) {
+        return false;
+    }
+    link_side* peer = &shared->side[!self];
+    bool done = false;
+
+    link_lock();
+    __atomic_store_n(&me->waiting, true, __ATOMIC_RELEASE);
+    while (!link_ready(me, ticks) && link_ahead(ticks) && !shared->closed) {
+        link_wait();
+    }
+    __atomic_store_n(&me->waiting, false, __ATOMIC_RELEASE);
+    if (link_ready(me, ticks) && me->armed) {
+        *in = me->in;
+        __atomic_store_n(&me->has_in, false, __ATOMIC_RELEASE);
+        me->armed = false;
+        peer->in = out;
+        peer->has_in = true;
+        done = true;
+        pthread_cond_broadcast(&shared->cond);
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return done;
+}
@@ -0,0 +1,118 @@
+#include <pacer.h>
+#include <emu.h>
+#include <apu.h>
+#include <time.h>
+
+static pacer_context ctx = { .speed = 1.0 };
+
+pacer_context* pacer_get_context() {
+    return &ctx;
+}
+
+static u64 pacer_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void pacer_rebase(u64 ticks) {
+    ctx.base_ns = pacer_now();
+    ctx.base_ticks = ticks;
+}
+
+void pacer_init(u64 ticks) {
+    pacer_rebase(ticks);
+    ctx.report_ns = ctx.base_ns;
+    ctx.frames = 0;
+    ctx.drift_total_ns = 0;
+    ctx.drift_max_ns = 0;
+}
+
+void pacer_set_speed(double speed) {
+    // Deadlines already passed were counted at the old speed.
+    ctx.speed = speed;
+    pacer_rebase(emu_get_context()->ticks);
+}
+
+void pacer_set_audio_sync(bool on) {
+    ctx.audio_sync = on;
+    pacer_rebase(emu_get_context()->ticks);
+}
+
+static void pacer_sleep(u64 ns) {
+    struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+    nanosleep(&ts, NULL);
+}
+
+static void pacer_wait(u64 deadline) {
+    u64 now = pacer_now();
+    if (now + PACER_SPIN_NS < deadline) {
+        pacer_sleep(deadline - now - PACER_SPIN_NS);
+    }
+    while (pacer_now() < deadline) {
+        // Spin out the last stretch, sleep wakeups are too coarse.
+    }
+}
+
+bool pacer_frame(u64 ticks) {
+    u64 now;
+    bool audio_paced = ctx.audio_sync && ctx.speed == 1.0 && apu_playing();
+    if (ctx.speed == PACER_TURBO) {
+        now = pacer_now();
+    } else if (audio_paced) {
+        // The audio device's clock sets the pace: emulate until the queue
+        // is back at its target, then wait for the device to drain it.
+        while (apu_queued_ms() > apu_target_ms()) {
+            pacer_sleep(PACER_AUDIO_POLL_NS);
+        }
+        now = pacer_now();
+        pacer_rebase(ticks);
+    } else {
+        double emulated_ns = (double)(ticks - ctx.base_ticks) * 1e9 / (EMU_CLOCK_HZ * ctx.speed);
+        u64 deadline = ctx.base_ns + (u64)emulated_ns;
+        pacer_wait(deadline);
+        now = pacer_now();
+
+        int64_t drift = (int64_t)(now - deadline);
+        if (drift > PACER_REBASE_NS) {
+            // Paused or stalled, catching up would only run in a burst.
+            pacer_rebase(ticks);
+        }
+        ctx.drift_total_ns += drift;
+        if (drift > ctx.drift_max_ns) {
+            ctx.drift_max_ns = drift;
+        }
+    }
+    ++ctx.frames;
+
+    if (now - ctx.report_ns < 1000000000ULL) {
+        return false;
+    }
+
+    double seconds = (now - ctx.report_ns) / 1e9;
+    if (ctx.speed == PACER_TURBO) {
+        printf("FPS: %.2f (turbo)\n", ctx.frames / seconds);
+    } else if (audio_paced) {
+        printf("FPS: %.2f audio queued %.1f ms\n", ctx.frames / seconds, apu_queued_ms());
+    } else {
+        printf("FPS: %.2f drift avg %lld us max %lld us\n", ctx.frames / seconds,
+            (long long)(ctx.drift_total_ns / ctx.frames / 1000), (long long)(ctx.drift_max_ns / 1000));
+    }
+    if (apu_playing()) {
+        apu_stats stats;
+        apu_get_stats(&stats);
+        if (stats.underruns != ctx.audio_underruns || stats.overruns != ctx.audio_overruns) {
+            printf("Audio: %llu underruns, %llu overruns (%llu frames dropped)\n",
+                (unsigned long long)(stats.underruns - ctx.audio_underruns),
+                (unsigned long long)(stats.overruns - ctx.audio_overruns),
+                (unsigned long long)stats.dropped_frames);
+            ctx.audio_underruns = stats.underruns;
+            ctx.audio_overruns = stats.overruns;
+        }
+    }
+    ctx.report_ns = now;
+    ctx.frames = 0;
+    ctx.drift_total_ns = 0;
+    ctx.drift_max_ns = 0;
+    return true;
+}
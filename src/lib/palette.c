@@ -0,0 +1,139 @@
+#include <palette.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define PALETTE_SSSE3 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define PALETTE_NEON 1
+#endif
+
+static const u32 colours_grey[4] = {0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000};
+static const u32 colours_green[4] = {0xFFE0F8D0, 0xFF88C070, 0xFF346856, 0xFF081820};
+
+// 16 entries so the SIMD kernels can look up any 4-bit index.
+static u32 lut[16] = {
+    0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000,
+    0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000,
+    0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000,
+};
+static u32 user_colours[PALETTE_ENTRIES];
+
+static void palette_fill(const u32 shades[4]) {
+    memset(lut, 0, sizeof(lut));
+    for (int pal=PAL_BG; pal<=PAL_OBP1; ++pal) {
+        for (int shade=0; shade<4; ++shade) {
+            lut[PIXEL_PACK(shade, pal)] = shades[shade];
+        }
+    }
+}
+
+void palette_select(palette_preset preset) {
+    switch (preset) {
+        case PALETTE_GREY:
+            palette_fill(colours_grey);
+            break;
+        case PALETTE_GREEN:
+            palette_fill(colours_green);
+            break;
+        case PALETTE_USER:
+            memset(lut, 0, sizeof(lut));
+            memcpy(lut, user_colours, sizeof(user_colours));
+            break;
+    }
+}
+
+void palette_set_user(const u32 colours[PALETTE_ENTRIES]) {
+    memcpy(user_colours, colours, sizeof(user_colours));
+    palette_select(PALETTE_USER);
+}
+
+const u32* palette_colours() {
+    return lut;
+}
+
+static void palette_convert_scalar(const u8* src, u32* dst, int count) {
+    for (int i=0; i<count; ++i) {
+        dst[i] = lut[src[i] & 0x0F];
+    }
+}
+
+#if PALETTE_SSSE3
+// One table per ARGB byte, pshufb looks up 16 pixels at a time.
+__attribute__((target("ssse3")))
+static void palette_convert_ssse3(const u8* src, u32* dst, int count) {
+    u8 planes[4][16];
+    for (int i=0; i<16; ++i) {
+        for (int b=0; b<4; ++b) {
+            planes[b][i] = (lut[i] >> (b * 8)) & 0xFF;
+        }
+    }
+    __m128i t0 = _mm_loadu_si128((const __m128i*)planes[0]);
+    __m128i t1 = _mm_loadu_si128((const __m128i*)planes[1]);
+    __m128i t2 = _mm_loadu_si128((const __m128i*)planes[2]);
+    __m128i t3 = _mm_loadu_si128((const __m128i*)planes[3]);
+    __m128i mask = _mm_set1_epi8(0x0F);
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i)), mask);
+        __m128i b0 = _mm_shuffle_epi8(t0, idx);
+        __m128i b1 = _mm_shuffle_epi8(t1, idx);
+        __m128i b2 = _mm_shuffle_epi8(t2, idx);
+        __m128i b3 = _mm_shuffle_epi8(t3, idx);
+
+        __m128i lo01 = _mm_unpacklo_epi8(b0, b1);
+        __m128i hi01 = _mm_unpackhi_epi8(b0, b1);
+        __m128i lo23 = _mm_unpacklo_epi8(b2, b3);
+        __m128i hi23 = _mm_unpackhi_epi8(b2, b3);
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(lo01, lo23));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(lo01, lo23));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpacklo_epi16(hi01, hi23));
+        _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_unpackhi_epi16(hi01, hi23));
+    }
+    palette_convert_scalar(src + i, dst + i, count - i);
+}
+#endif
+
+#if PALETTE_NEON
+static void palette_convert_neon(const u8* src, u32* dst, int count) {
+    u8 planes[4][16];
+    for (int i=0; i<16; ++i) {
+        for (int b=0; b<4; ++b) {
+            planes[b][i] = (lut[i] >> (b * 8)) & 0xFF;
+        }
+    }
+    uint8x16_t t0 = vld1q_u8(planes[0]);
+    uint8x16_t t1 = vld1q_u8(planes[1]);
+    uint8x16_t t2 = vld1q_u8(planes[2]);
+    uint8x16_t t3 = vld1q_u8(planes[3]);
+    uint8x16_t mask = vdupq_n_u8(0x0F);
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t idx = vandq_u8(vld1q_u8(src + i), mask);
+        uint8x16x4_t px;
+        px.val[0] = vqtbl1q_u8(t0, idx);
+        px.val[1] = vqtbl1q_u8(t1, idx);
+        px.val[2] = vqtbl1q_u8(t2, idx);
+        px.val[3] = vqtbl1q_u8(t3, idx);
+        vst4q_u8((u8*)(dst + i), px);
+    }
+    palette_convert_scalar(src + i, dst + i, count - i);
+}
+#endif
+
+void palette_convert(const u8* src, u32* dst, int count) {
+#if PALETTE_SSSE3
+    if (__builtin_cpu_supports("ssse3")) {
+        palette_convert_ssse3(src, dst, count);
+        return;
+    }
+#elif PALETTE_NEON
+    palette_convert_neon(src, dst, count);
+    return;
+#endif
+    palette_convert_scalar(src, dst, count);
+}
@@ -1,21 +1,50 @@
 #include <ppu.h>
 #include <lcd.h>
 #include <string.h>
+#include <time.h>
 #include <ppu_sm.h>
+#include <emu.h>
+#include <compose.h>
+#include <ppu_thread.h>
+#include <ppu_parallel.h>
 
 void pipeline_fifo_reset();
 void pipeline_process();
 
-static ppu_context ctx;
+// The presenter waits on frame_cond from emu_run before the emulation
+// thread gets to ppu_init, so they are initialised statically.
+static ppu_context ctx = {
+    .frame_lock = PTHREAD_MUTEX_INITIALIZER,
+    .frame_cond = PTHREAD_COND_INITIALIZER
+};
 
 ppu_context *ppu_get_context() {
     return &ctx;
 }
 
+static void ppu_set_back_buffer() {
+    ctx.video_buffer = NULL;
+    ctx.index_buffer = NULL;
+    if (ctx.indexed) {
+        ctx.index_buffer = ctx.frame_buffers[ctx.frame_back];
+    } else {
+        ctx.video_buffer = ctx.frame_buffers[ctx.frame_back];
+    }
+}
+
 void ppu_init() {
+    compose_init();
     ctx.current_frame = 0;
     ctx.line_ticks = 0;
-    ctx.video_buffer = malloc(YRES * XRES * sizeof(32));
+    size_t buffer_size = YRES * XRES * (ctx.indexed ? sizeof(u8) : sizeof(u32));
+    for (int i=0; i<FRAME_BUFFERS; i++) {
+        ctx.frame_buffers[i] = malloc(buffer_size);
+        memset(ctx.frame_buffers[i], 0, buffer_size);
+    }
+    ctx.frame_back = 0;
+    ctx.frame_ready = 1;
+    ctx.frame_front = 2;
+    ppu_set_back_buffer();
 
     ctx.pfc.line_x = 0;
     ctx.pfc.pushed_x = 0;
@@ -25,33 +54,143 @@ void ppu_init() {
     ctx.pfc.cur_fetch_state = FS_TILE;
 
     ctx.line_sprites = 0;
-    ctx.fetched_entry_count = 0;
     ctx.window_line = 0;
 
+    ctx.skip_frame = false;
+    ctx.skip_count = 0;
+
     lcd_init();
-    LCDS_MODE_SET(MODE_OAM);
+    ppu_sm_init();
+    ppu_sm_start(emu_get_context()->ticks);
 
     memset(ctx.oam_ram, 0, sizeof(ctx.oam_ram));
-    memset(ctx.video_buffer, 0, YRES * XRES * sizeof(u32));
+    sprite_index_reset();
+
+    // Nothing has been presented yet, the first frame is dirty everywhere.
+    memset(ctx.line_hash, 0, sizeof(ctx.line_hash));
+    memset(ctx.dirty_frame, 0xFF, sizeof(ctx.dirty_frame));
+    memset(ctx.dirty_lines, 0, sizeof(ctx.dirty_lines));
+    ctx.frame_hash = 0;
+
+    if (ctx.renderer == RENDER_THREAD) {
+        render_thread_start();
+    } else if (ctx.renderer == RENDER_PARALLEL) {
+        parallel_init();
+    }
 }
 
-void ppu_tick() {
-    ctx.line_ticks++;
+// After a save state load. The thread and parallel renderers draw from
+// their own VRAM/OAM copies, which start over from the loaded memory.
+void ppu_state_loaded() {
+    if (ctx.renderer == RENDER_THREAD) {
+        render_thread_resync();
+    } else if (ctx.renderer == RENDER_PARALLEL) {
+        parallel_resync();
+    }
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+#define HASH_PRIME 0x100000001b3ULL
 
-    switch(LCDS_MODE) {
-    case MODE_OAM:
-        ppu_mode_oam();
-        break;
-    case MODE_XFER:
-        ppu_mode_xfer();
-        break;
-    case MODE_VBLANK:
-        ppu_mode_vblank();
-        break;
-    case MODE_HBLANK:
-        ppu_mode_hblank();
-        break;
+static u64 hash_words(u64 hash, const u64* words, int count) {
+    for (int i=0; i<count; i++) {
+        hash = (hash ^ words[i]) * HASH_PRIME;
     }
+    return hash;
+}
+
+// Called once the current line has been written to the framebuffer.
+void ppu_line_done(u8 ly) {
+    u64 hash;
+    if (ctx.indexed) {
+        hash = hash_words(HASH_SEED, (u64*)(ctx.index_buffer + (ly * XRES)), XRES / 8);
+    } else {
+        hash = hash_words(HASH_SEED, (u64*)(ctx.video_buffer + (ly * XRES)), XRES / 2);
+    }
+
+    if (hash != ctx.line_hash[ly]) {
+        ctx.line_hash[ly] = hash;
+        ctx.dirty_frame[ly / 64] |= 1ULL << (ly % 64);
+    }
+}
+
+// Called on entering VBlank, publishes the frame and the lines that
+// changed in it. The frame goes first so a presenter that sees the dirty
+// lines always finds a frame at least that new.
+void ppu_frame_done() {
+    ctx.frame_hash = hash_words(HASH_SEED, ctx.line_hash, YRES);
+
+    u32 ready = __atomic_exchange_n(&ctx.frame_ready, ctx.frame_back | FRAME_FRESH, __ATOMIC_ACQ_REL);
+    ctx.frame_back = ready & ~FRAME_FRESH;
+    ppu_set_back_buffer();
+
+    for (int i=0; i<DIRTY_WORDS; i++) {
+        __atomic_fetch_or(&ctx.dirty_lines[i], ctx.dirty_frame[i], __ATOMIC_RELEASE);
+        ctx.dirty_frame[i] = 0;
+    }
+
+    pthread_mutex_lock(&ctx.frame_lock);
+    pthread_cond_signal(&ctx.frame_cond);
+    pthread_mutex_unlock(&ctx.frame_lock);
+}
+
+// Presenter side: moves the newest complete frame to the front, returns
+// false if there has been none since the last call.
+bool ppu_acquire_frame() {
+    if (!(__atomic_load_n(&ctx.frame_ready, __ATOMIC_ACQUIRE) & FRAME_FRESH)) {
+        return false;
+    }
+    u32 ready = __atomic_exchange_n(&ctx.frame_ready, ctx.frame_front, __ATOMIC_ACQ_REL);
+    ctx.frame_front = ready & ~FRAME_FRESH;
+    return true;
+}
+
+// Presenter side: sleeps until a frame is ready to acquire or the timeout
+// passes, returns whether one is ready.
+bool ppu_wait_frame(u32 timeout_ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += (long)timeout_ms * 1000000;
+    until.tv_sec += until.tv_nsec / 1000000000;
+    until.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&ctx.frame_lock);
+    while (!(__atomic_load_n(&ctx.frame_ready, __ATOMIC_ACQUIRE) & FRAME_FRESH)) {
+        if (pthread_cond_timedwait(&ctx.frame_cond, &ctx.frame_lock, &until)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctx.frame_lock);
+    return __atomic_load_n(&ctx.frame_ready, __ATOMIC_ACQUIRE) & FRAME_FRESH;
+}
+
+const void* ppu_front_buffer() {
+    return ctx.frame_buffers[ctx.frame_front];
+}
+
+// Asks for the next frame to be drawn when rendering on request.
+void ppu_request_frame() {
+    __atomic_store_n(&ctx.frame_requested, true, __ATOMIC_RELEASE);
+}
+
+// Moves the changed lines into lines and clears them, returns false if
+// nothing changed since the last call.
+bool ppu_take_dirty_lines(u64* lines) {
+    bool any = false;
+    for (int i=0; i<DIRTY_WORDS; i++) {
+        lines[i] = __atomic_exchange_n(&ctx.dirty_lines[i], 0, __ATOMIC_ACQUIRE);
+        any |= lines[i] != 0;
+    }
+    return any;
+}
+
+void ppu_tick() {
+    if (!ctx.dot_active) {
+        return;
+    }
+
+    ctx.line_ticks++;
+    ppu_mode_xfer();
 }
 
 
@@ -60,7 +199,20 @@ void ppu_oam_write(u16 address, u8 value) {
         address -= 0xFE00;
     }
 
+    if (ctx.renderer == RENDER_THREAD) {
+        render_queue_write(RQ_OAM, address, value);
+    } else if (ctx.renderer == RENDER_PARALLEL) {
+        parallel_oam_write(address, value);
+    }
+
     u8 *p = (u8 *)ctx.oam_ram;
+    if ((address & 0b11) < 2 && p[address] != value) {
+        // y or x moved, update the lines this sprite covers.
+        sprite_index_remove(address / 4);
+        p[address] = value;
+        sprite_index_add(address / 4);
+        return;
+    }
     p[address] = value;
 }
 
@@ -74,6 +226,11 @@ u8 ppu_oam_read(u16 address) {
 }
 
 void ppu_vram_write(u16 address, u8 value) {
+    if (ctx.renderer == RENDER_THREAD) {
+        render_queue_write(RQ_VRAM, address, value);
+    } else if (ctx.renderer == RENDER_PARALLEL) {
+        parallel_vram_write(address, value);
+    }
     ctx.vram[address - 0x8000] = value;
 }
 
@@ -0,0 +1,145 @@
+#include <ppu_parallel.h>
+#include <string.h>
+#include <unistd.h>
+
+static parallel_context ctx;
+
+parallel_context* parallel_get_context() {
+    return &ctx;
+}
+
+// Live snapshot, copied first if a captured line still needs the old one.
+static vram_snapshot* parallel_writable() {
+    if (ctx.snapshot_shared) {
+        vram_snapshot* live = ctx.snapshots[ctx.snapshot_count - 1];
+        memcpy(ctx.snapshots[ctx.snapshot_count], live, sizeof(vram_snapshot));
+        ++ctx.snapshot_count;
+        ctx.snapshot_shared = false;
+    }
+    return ctx.snapshots[ctx.snapshot_count - 1];
+}
+
+void parallel_vram_write(u16 address, u8 value) {
+    vram_snapshot* live = ctx.snapshots[ctx.snapshot_count - 1];
+    if (live->vram[address - 0x8000] != value) {
+        parallel_writable()->vram[address - 0x8000] = value;
+    }
+}
+
+void parallel_oam_write(u16 address, u8 value) {
+    vram_snapshot* live = ctx.snapshots[ctx.snapshot_count - 1];
+    if (((u8 *)live->oam_ram)[address] != value) {
+        ((u8 *)parallel_writable()->oam_ram)[address] = value;
+    }
+}
+
+void parallel_capture_line() {
+    parallel_line* line = &ctx.lines[ctx.line_count++];
+    scanline_capture(&line->state);
+    line->snapshot = ctx.snapshot_count - 1;
+    ctx.snapshot_shared = true;
+}
+
+static void parallel_work(u32 generation, u32 count) {
+    u64 next = __atomic_load_n(&ctx.next_line, __ATOMIC_ACQUIRE);
+    while ((u32)(next >> 32) == generation && (u32)next < count) {
+        if (!__atomic_compare_exchange_n(&ctx.next_line, &next, next + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        parallel_line* line = &ctx.lines[(u32)next];
+        vram_snapshot* snap = ctx.snapshots[line->snapshot];
+        scanline_draw(&line->state, snap->vram, snap->oam_ram);
+
+        if (__atomic_add_fetch(&ctx.lines_done, 1, __ATOMIC_ACQ_REL) == count) {
+            pthread_mutex_lock(&ctx.lock);
+            pthread_cond_signal(&ctx.done);
+            pthread_mutex_unlock(&ctx.lock);
+        }
+        next = __atomic_load_n(&ctx.next_line, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void* parallel_worker(void* p) {
+    u32 seen = 0;
+    while (true) {
+        pthread_mutex_lock(&ctx.lock);
+        while (ctx.generation == seen) {
+            pthread_cond_wait(&ctx.start, &ctx.lock);
+        }
+        seen = ctx.generation;
+        u32 count = ctx.batch_lines;
+        pthread_mutex_unlock(&ctx.lock);
+
+        parallel_work(seen, count);
+    }
+    return NULL;
+}
+
+// Draws every line captured so far and starts a new set of snapshots.
+void parallel_render_frame() {
+    if (ctx.line_count) {
+        pthread_mutex_lock(&ctx.lock);
+        u32 generation = ++ctx.generation;
+        ctx.batch_lines = ctx.line_count;
+        ctx.lines_done = 0;
+        __atomic_store_n(&ctx.next_line, (u64)generation << 32, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&ctx.start);
+        pthread_mutex_unlock(&ctx.lock);
+
+        // The emulation thread draws lines too instead of just waiting.
+        parallel_work(generation, ctx.line_count);
+
+        pthread_mutex_lock(&ctx.lock);
+        while (__atomic_load_n(&ctx.lines_done, __ATOMIC_ACQUIRE) != ctx.batch_lines) {
+            pthread_cond_wait(&ctx.done, &ctx.lock);
+        }
+        pthread_mutex_unlock(&ctx.lock);
+
+        for (u32 i=0; i<ctx.line_count; i++) {
+            ppu_line_done(ctx.lines[i].state.ly);
+        }
+    }
+
+    // Keep the live snapshot as the first one of the next frame.
+    vram_snapshot* live = ctx.snapshots[ctx.snapshot_count - 1];
+    ctx.snapshots[ctx.snapshot_count - 1] = ctx.snapshots[0];
+    ctx.snapshots[0] = live;
+    ctx.snapshot_count = 1;
+    ctx.snapshot_shared = false;
+    ctx.line_count = 0;
+}
+
+void parallel_resync() {
+    memcpy(ctx.snapshots[0]->vram, ppu_get_context()->vram, sizeof(ctx.snapshots[0]->vram));
+    memcpy(ctx.snapshots[0]->oam_ram, ppu_get_context()->oam_ram, sizeof(ctx.snapshots[0]->oam_ram));
+    ctx.snapshot_count = 1;
+    ctx.snapshot_shared = false;
+    ctx.line_count = 0;
+}
+
+void parallel_init() {
+    for (int i=0; i<SNAPSHOT_COUNT; i++) {
+        ctx.snapshots[i] = malloc(sizeof(vram_snapshot));
+    }
+    parallel_resync();
+    ctx.generation = 0;
+    ctx.batch_lines = 0;
+    ctx.next_line = 0;
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.start, NULL);
+    pthread_cond_init(&ctx.done, NULL);
+
+    // The emulation thread is one of the renderers.
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    ctx.worker_count = cores > 1 ? cores - 1 : 0;
+    if (ctx.worker_count > PARALLEL_MAX_WORKERS) {
+        ctx.worker_count = PARALLEL_MAX_WORKERS;
+    }
+    for (int i=0; i<ctx.worker_count; i++) {
+        if (pthread_create(&ctx.workers[i], NULL, parallel_worker, NULL) != 0) {
+            fprintf(stderr, "Failed to create render worker\n");
+            exit(-9);
+        }
+    }
+}
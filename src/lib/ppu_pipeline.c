@@ -2,12 +2,20 @@
 #include <lcd.h>
 #include <common.h>
 #include <bus.h>
+#include <palette.h>
+#include <compose.h>
+#include <string.h>
 
 bool window_visible() {
     return LCDC_WIN_ENABLE && lcd_get_context()->win_x >= 0 && lcd_get_context()->win_x <= 166 && lcd_get_context()->win_y >= 0 && lcd_get_context()->win_y < YRES;
 }
 
-void pixel_fifo_push(u32 value) {
+bool window_on_line() {
+    u8 ly = lcd_get_context()->ly;
+    return window_visible() && ly >= lcd_get_context()->win_y && ly < lcd_get_context()->win_y + XRES;
+}
+
+void pixel_fifo_push(u8 value) {
     fifo_entry* next = malloc(sizeof(fifo_entry));
     next->next = NULL;
     next->value = value;
@@ -20,7 +28,7 @@ void pixel_fifo_push(u32 value) {
      ++ppu_get_context()->pfc.pixel_fifo.size;
 }
 
-u32 pixel_fifo_pop() {
+u8 pixel_fifo_pop() {
     if (ppu_get_context()->pfc.pixel_fifo.size <= 0) {
         fprintf(stderr, "ERR IN PIXEL FIFO\n");
         exit(-8);
@@ -28,45 +36,11 @@ u32 pixel_fifo_pop() {
     fifo_entry* popped = ppu_get_context()->pfc.pixel_fifo.head;
     ppu_get_context()->pfc.pixel_fifo.head = ppu_get_context()->pfc.pixel_fifo.head->next;
     --ppu_get_context()->pfc.pixel_fifo.size;
-    u32 val = popped->value;
+    u8 val = popped->value;
     free(popped);
     return val;
 }
 
-u32 fetch_sprite_pixels(int bit, u32 colour, u8 bg_colour) {
-    int i;
-    for(i=0;i<ppu_get_context()->fetched_entry_count;++i) {
-        int sp_x = (ppu_get_context()->fetched_entries[i].x - 8) + ((lcd_get_context()->sc_x % 8));
-        if (sp_x + 8 < ppu_get_context()->pfc.fifo_x) {
-            continue;
-        }
-
-        int offset = ppu_get_context()->pfc.fifo_x-sp_x;
-        if (offset < 0 || offset > 7) {
-            continue;
-        }
-        bit = (7-offset);
-        if (ppu_get_context()->fetched_entries[i].f_x_flip) {
-            bit = offset;
-        }
-        u8 hi = !!(ppu_get_context()->pfc.fetch_entry_data[(i*2)] & (1<<bit));
-        u8 lo = !!(ppu_get_context()->pfc.fetch_entry_data[(i*2)+1] & (1<<bit)) << 1;
-        
-        bool bg_priority = ppu_get_context()->fetched_entries[i].f_bgp;
-        if (!(hi|lo)) {
-            continue;
-        }
-        if (!bg_priority || bg_colour == 0) {
-            colour = (ppu_get_context()->fetched_entries[i].f_pn) ? lcd_get_context()->sp2_colours[hi|lo] : lcd_get_context()->sp1_colours[hi|lo];
-
-            if (hi|lo) {
-                break;
-            }
-        }
-     }
-     return colour;
-}
-
 bool pipeline_fifo_add() {
     if (ppu_get_context()->pfc.pixel_fifo.size > 8) {
         //fifo is full!
@@ -74,60 +48,39 @@ bool pipeline_fifo_add() {
     }
 
     int x = ppu_get_context()->pfc.fetch_x - (8 - (lcd_get_context()->sc_x % 8));
+    if (x < 0) {
+        return true;
+    }
 
-    for (int i=0; i<8; i++) {
-        int bit = 7 - i;
-        u8 hi = !!(ppu_get_context()->pfc.bgw_fetch_data[1] & (1 << bit));
-        u8 lo = !!(ppu_get_context()->pfc.bgw_fetch_data[2] & (1 << bit)) << 1;
-        u32 colour = lcd_get_context()->bg_colours[hi | lo];
-
-        if (!LCDC_BGW_ENABLE) {
-            colour = lcd_get_context()->bg_colours[0];
-        }
-
-        if (LCDC_OBJ_ENABLE) {
-            colour = fetch_sprite_pixels(bit, colour, hi | lo);
-        }
+    if (ppu_get_context()->skip_frame) {
+        // Only the FIFO's fill level matters for timing.
+        ppu_get_context()->pfc.pixel_fifo.size += 8;
+        ppu_get_context()->pfc.fifo_x += 8;
+        return true;
+    }
 
-        if (x >= 0) {
-            pixel_fifo_push(colour);
-            ppu_get_context()->pfc.fifo_x++;
-        }
+    u8 bg[8];
+    u8 pixels[8];
+    if (LCDC_BGW_ENABLE) {
+        compose_decode(&ppu_get_context()->pfc.bgw_fetch_data[1], 1, bg);
+    } else {
+        memset(bg, 0, sizeof(bg));
     }
-    return true;
-}
 
-void pipeline_load_sprite_tile() {
-    oam_line_entry* le = ppu_get_context()->line_sprites;
-    while (le) {
-        int sp_x = (le->entry.x - 8) + (lcd_get_context()->sc_x % 8);
-        if ((sp_x >= ppu_get_context()->pfc.fetch_x && sp_x < ppu_get_context()->pfc.fetch_x + 8) || (
-            (sp_x + 8) >= ppu_get_context()->pfc.fetch_x && (sp_x + 8) < ppu_get_context()->pfc.fetch_x + 8
-        )) {
-            ppu_get_context()->fetched_entries[ppu_get_context()->fetched_entry_count++] = le->entry;
+    const u8* overlay = NULL;
+    if (LCDC_OBJ_ENABLE && ppu_get_context()->line_sprites) {
+        int px = ppu_get_context()->pfc.fifo_x - (lcd_get_context()->sc_x % 8);
+        if (px >= -OVERLAY_PAD && px < XRES) {
+            overlay = ppu_get_context()->sprite_overlay + OVERLAY_PAD + px;
         }
-        le = le->next;
-        if (!le || ppu_get_context()->fetched_entry_count >= 3) {
-            break;
-        } 
     }
-}
+    compose_merge(bg, overlay, lcd_get_context()->pixel_map, pixels, 8);
 
-void pipeline_load_sprite_data(u8 offset) {
-    int curr_y = lcd_get_context()->ly;
-    u8 sprite_height = LCDC_OBJ_HEIGHT;
-    int i;
-    for(i=0;i<ppu_get_context()->fetched_entry_count;++i) {
-        u8 ty = ((curr_y + 16) - ppu_get_context()->fetched_entries[i].y) * 2;
-        if (ppu_get_context()->fetched_entries[i].f_y_flip) {
-            ty = ((sprite_height*2)-2)-ty;
-        }
-        u8 tile_index = ppu_get_context()->fetched_entries[i].tile;
-        if (sprite_height == 16) {
-            tile_index &= ~(1);
-        }
-        ppu_get_context()->pfc.fetch_entry_data[(i*2)+offset] = bus_read(0x8000 + (tile_index*16) + ty + offset);
+    for (int i=0; i<8; i++) {
+        pixel_fifo_push(pixels[i]);
     }
+    ppu_get_context()->pfc.fifo_x += 8;
+    return true;
 }
 
 void pipeline_load_window_tile() {
@@ -156,7 +109,6 @@ void pipeline_load_window_tile() {
 void pipeline_fetch() {
     switch(ppu_get_context()->pfc.cur_fetch_state) {
         case FS_TILE: {
-            ppu_get_context()->fetched_entry_count = 0;
             if (LCDC_BGW_ENABLE) {
                 ppu_get_context()->pfc.bgw_fetch_data[0] = bus_read(LCDC_BG_MAP_AREA + 
                     (ppu_get_context()->pfc.map_x / 8) + 
@@ -168,10 +120,6 @@ void pipeline_fetch() {
                 pipeline_load_window_tile();
             }
 
-            if (LCDC_OBJ_ENABLE && ppu_get_context()->line_sprites) {
-                pipeline_load_sprite_tile();
-            }
- 
             ppu_get_context()->pfc.cur_fetch_state = FS_DATA0;
             ppu_get_context()->pfc.fetch_x += 8;
         } break;
@@ -180,7 +128,6 @@ void pipeline_fetch() {
             ppu_get_context()->pfc.bgw_fetch_data[1] = bus_read(LCDC_BGW_DATA_AREA +
                 (ppu_get_context()->pfc.bgw_fetch_data[0] * 16) + 
                 ppu_get_context()->pfc.tile_y);
-            pipeline_load_sprite_data(0);
             ppu_get_context()->pfc.cur_fetch_state = FS_DATA1;
         } break;
 
@@ -188,7 +135,6 @@ void pipeline_fetch() {
             ppu_get_context()->pfc.bgw_fetch_data[2] = bus_read(LCDC_BGW_DATA_AREA +
                 (ppu_get_context()->pfc.bgw_fetch_data[0] * 16) + 
                 ppu_get_context()->pfc.tile_y + 1);
-            pipeline_load_sprite_data(1);
             ppu_get_context()->pfc.cur_fetch_state = FS_IDLE;
 
         } break;
@@ -209,10 +155,24 @@ void pipeline_fetch() {
 
 void pipeline_push_pixel() {
     if (ppu_get_context()->pfc.pixel_fifo.size > 8) {
-        u32 pixel_data = pixel_fifo_pop();
+        if (ppu_get_context()->skip_frame) {
+            --ppu_get_context()->pfc.pixel_fifo.size;
+            if (ppu_get_context()->pfc.line_x >= (lcd_get_context()->sc_x % 8)) {
+                ++ppu_get_context()->pfc.pushed_x;
+            }
+            ++ppu_get_context()->pfc.line_x;
+            return;
+        }
+
+        u8 pixel_data = pixel_fifo_pop();
 
         if (ppu_get_context()->pfc.line_x >= (lcd_get_context()->sc_x % 8)) {
-            ppu_get_context()->video_buffer[ppu_get_context()->pfc.pushed_x + (lcd_get_context()->ly * XRES)] = pixel_data;
+            u32 offset = ppu_get_context()->pfc.pushed_x + (lcd_get_context()->ly * XRES);
+            if (ppu_get_context()->indexed) {
+                ppu_get_context()->index_buffer[offset] = pixel_data;
+            } else {
+                ppu_get_context()->video_buffer[offset] = palette_colours()[pixel_data];
+            }
             ++ppu_get_context()->pfc.pushed_x;
         }
         ++ppu_get_context()->pfc.line_x;
@@ -231,6 +191,10 @@ void pipeline_process() {
 }
 
 void pipeline_fifo_reset() {
+    if (ppu_get_context()->skip_frame) {
+        // A skipped frame's FIFO only holds a count.
+        ppu_get_context()->pfc.pixel_fifo.size = 0;
+    }
     while(ppu_get_context()->pfc.pixel_fifo.size) {
         pixel_fifo_pop();
     }
@@ -0,0 +1,151 @@
+#include <ppu.h>
+#include <lcd.h>
+#include <compose.h>
+#include <palette.h>
+#include <string.h>
+
+// Whole-line renderer used instead of the pixel FIFO. It reproduces the
+// FIFO's output for the register state at the start of mode 3.
+//
+// render_line() is instantiated once per LCDC configuration below, so
+// the loops only ever see compile-time constants for the config flags.
+// It only reads the line_state and the VRAM/OAM it is given, so it can
+// run on the render thread against its own copies.
+
+#define LINE_FETCHES 21 // tiles touched by 160 pixels plus the fine scroll
+
+#define STATE_BG_MAP_AREA(s) (BIT((s)->lcdc, 3) ? 0x9C00 : 0x9800)
+#define STATE_WIN_MAP_AREA(s) (BIT((s)->lcdc, 6) ? 0x9C00 : 0x9800)
+
+static inline __attribute__((always_inline))
+void fetch_tile(const u8* vram, u8 tile, bool signed_data, u8 tile_y, u8* planes) {
+    u16 data_area = signed_data ? 0x0800 : 0x0000;
+    if (signed_data) {
+        tile += 128;
+    }
+    planes[0] = vram[data_area + (tile * 16) + tile_y];
+    planes[1] = vram[data_area + (tile * 16) + tile_y + 1];
+}
+
+static inline __attribute__((always_inline))
+void render_line(const line_state* state, const u8* vram, const oam_entry* oam,
+        bool bg_on, bool win_on, u8 obj_height, bool signed_data) {
+    u8 ly = state->ly;
+    u8 sc_x = state->sc_x;
+    u8 fine_x = sc_x % 8;
+
+    u8 bg[LINE_FETCHES * 8];
+    u8 pixels[XRES];
+
+    if (bg_on) {
+        u8 planes[LINE_FETCHES * 2];
+        u8 map_y = ly + state->sc_y;
+        u8 tile_y = (map_y % 8) * 2;
+        const u8* bg_row = vram + (STATE_BG_MAP_AREA(state) - 0x8000) + ((map_y / 8) * 32);
+
+        int win_first = LINE_FETCHES;
+        int win_last = LINE_FETCHES;
+        if (win_on) {
+            // Fetches whose fetch_x + 7 falls inside the window.
+            win_first = state->win_x / 8;
+            win_last = (state->win_x + 158) / 8;
+            if (win_last > LINE_FETCHES) {
+                win_last = LINE_FETCHES;
+            }
+        }
+
+        int k = 0;
+        for (; k < win_first; ++k) {
+            u8 map_x = (k * 8) + sc_x;
+            fetch_tile(vram, bg_row[map_x / 8], signed_data, tile_y, &planes[k * 2]);
+        }
+        if (win_on) {
+            const u8* win_row = vram + (STATE_WIN_MAP_AREA(state) - 0x8000) + ((state->window_line / 8) * 32);
+            for (; k < win_last; ++k) {
+                u8 col = ((k * 8) + 7 - state->win_x) / 8;
+                fetch_tile(vram, win_row[col], signed_data, tile_y, &planes[k * 2]);
+            }
+            for (; k < LINE_FETCHES; ++k) {
+                u8 map_x = (k * 8) + sc_x;
+                fetch_tile(vram, bg_row[map_x / 8], signed_data, tile_y, &planes[k * 2]);
+            }
+        }
+        compose_decode(planes, LINE_FETCHES, bg);
+    } else {
+        memset(bg, 0, sizeof(bg));
+    }
+
+    u8 padded[XRES + (OVERLAY_PAD * 2)];
+    const u8* overlay = NULL;
+    if (obj_height && state->sprites.count) {
+        sprite_overlay_draw(&state->sprites, oam, vram, ly, obj_height, padded);
+        overlay = padded + OVERLAY_PAD;
+    }
+    compose_merge(bg + fine_x, overlay, state->pixel_map, pixels, XRES);
+
+    if (ppu_get_context()->indexed) {
+        memcpy(ppu_get_context()->index_buffer + (ly * XRES), pixels, XRES);
+    } else {
+        palette_convert(pixels, ppu_get_context()->video_buffer + (ly * XRES), XRES);
+    }
+}
+
+typedef void (*line_renderer)(const line_state* state, const u8* vram, const oam_entry* oam);
+
+#define LINE_RENDERER(bg, win, obj, sdata) \
+    static void render_##bg##_##win##_##obj##_##sdata(const line_state* state, const u8* vram, const oam_entry* oam) { \
+        render_line(state, vram, oam, bg, win, obj, sdata); \
+    }
+
+#define LINE_RENDERERS_OBJ(bg, win, obj) \
+    LINE_RENDERER(bg, win, obj, 0) \
+    LINE_RENDERER(bg, win, obj, 1)
+
+#define LINE_RENDERERS_WIN(bg, win) \
+    LINE_RENDERERS_OBJ(bg, win, 0) \
+    LINE_RENDERERS_OBJ(bg, win, 8) \
+    LINE_RENDERERS_OBJ(bg, win, 16)
+
+LINE_RENDERERS_WIN(0, 0)
+LINE_RENDERERS_WIN(0, 1)
+LINE_RENDERERS_WIN(1, 0)
+LINE_RENDERERS_WIN(1, 1)
+
+#define OBJ_ENTRIES(bg, win, obj) { render_##bg##_##win##_##obj##_0, render_##bg##_##win##_##obj##_1 }
+#define WIN_ENTRIES(bg, win) { OBJ_ENTRIES(bg, win, 0), OBJ_ENTRIES(bg, win, 8), OBJ_ENTRIES(bg, win, 16) }
+
+// [bg enabled][window on this line][sprites off/8x8/8x16][signed tile data]
+static const line_renderer renderers[2][2][3][2] = {
+    { WIN_ENTRIES(0, 0), WIN_ENTRIES(0, 1) },
+    { WIN_ENTRIES(1, 0), WIN_ENTRIES(1, 1) },
+};
+
+void scanline_capture(line_state* state) {
+    state->ly = lcd_get_context()->ly;
+    state->lcdc = lcd_get_context()->lcdc;
+    state->sc_x = lcd_get_context()->sc_x;
+    state->sc_y = lcd_get_context()->sc_y;
+    state->win_x = lcd_get_context()->win_x;
+    state->window_line = ppu_get_context()->window_line;
+    state->window = LCDC_BGW_ENABLE && window_on_line();
+    memcpy(state->pixel_map, lcd_get_context()->pixel_map, sizeof(state->pixel_map));
+
+    state->sprites.count = 0;
+    if (LCDC_OBJ_ENABLE && ppu_get_context()->line_sprites) {
+        state->sprites = *ppu_get_context()->line_sprites;
+    }
+}
+
+void scanline_draw(const line_state* state, const u8* vram, const oam_entry* oam) {
+    bool bg_on = BIT(state->lcdc, 0);
+    int obj = BIT(state->lcdc, 1) ? (BIT(state->lcdc, 2) ? 2 : 1) : 0;
+    bool signed_data = !BIT(state->lcdc, 4);
+
+    renderers[bg_on][state->window][obj][signed_data](state, vram, oam);
+}
+
+void scanline_render() {
+    line_state state;
+    scanline_capture(&state);
+    scanline_draw(&state, ppu_get_context()->vram, ppu_get_context()->oam_ram);
+}
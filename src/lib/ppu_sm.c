@@ -3,9 +3,32 @@
 #include <cpu.h>
 #include <interrupts.h>
 #include <ppu.h>
+#include <emu.h>
+#include <scheduler.h>
 #include <common.h>
 #include <string.h>
 #include <cart.h>
+#include <pacer.h>
+#include <ppu_thread.h>
+#include <ppu_parallel.h>
+
+// Line timings in dots from the start of the line.
+#define OAM_SCAN_TICK 1
+#define XFER_START_TICK 80
+
+// Mode 3 penalties in dots.
+#define XFER_MIN_DOTS 172
+#define XFER_WINDOW_DOTS 6
+#define XFER_SPRITE_DOTS 6
+#define XFER_SPRITE_ALIGN_DOTS 5
+
+static void ppu_oam_scan(u64 ticks);
+static void ppu_xfer_start(u64 ticks);
+static void ppu_line_end(u64 ticks);
+
+static void ppu_schedule(u32 line_tick, sched_callback callback) {
+    sched_add(SCHED_PPU, ppu_get_context()->line_start + line_tick, callback);
+}
 
 void increment_ly() {
     if (window_visible() && lcd_get_context()->ly >= lcd_get_context()->win_y && lcd_get_context()->ly < lcd_get_context()->win_y + YRES) {
@@ -23,135 +46,251 @@ void increment_ly() {
 }
 
 void load_line_sprites() {
-    int cur_y = lcd_get_context()->ly;
-
-    u8 sprite_height = LCDC_OBJ_HEIGHT;
-    memset(ppu_get_context()->line_entry_array, 0, sizeof(ppu_get_context()->line_entry_array));
-    int i;
-    for(i=0;i<40;++i) {
-        oam_entry e = ppu_get_context()->oam_ram[i];
-        if (!e.x) {
-            continue;
+    sprite_line* line = sprite_index_line(lcd_get_context()->ly);
+    if (line && line->count) {
+        ppu_get_context()->line_sprites = line;
+        ppu_get_context()->line_sprite_count = line->count;
+    }
+}
+
+// Decides whether the frame starting now is drawn.
+static void ppu_frame_start() {
+    ppu_context* ppu = ppu_get_context();
+    if (emu_get_context()->headless) {
+        ppu->skip_frame = true;
+    } else if (ppu->render_on_request) {
+        ppu->skip_frame = !__atomic_exchange_n(&ppu->frame_requested, false, __ATOMIC_ACQUIRE);
+    } else if (ppu->frame_skip > 1) {
+        ppu->skip_frame = ppu->skip_count != 0;
+        ppu->skip_count = (ppu->skip_count + 1) % ppu->frame_skip;
+    } else {
+        ppu->skip_frame = false;
+    }
+}
+
+static void ppu_oam_scan(u64 ticks) {
+    ppu_get_context()->line_ticks = ticks - ppu_get_context()->line_start;
+    ppu_get_context()->line_sprites = 0;
+    ppu_get_context()->line_sprite_count = 0;
+
+    load_line_sprites();
+    ppu_schedule(XFER_START_TICK, ppu_xfer_start);
+}
+
+u32 ppu_xfer_length() {
+    u8 sc_x = lcd_get_context()->sc_x;
+    u8 win_x = lcd_get_context()->win_x;
+    u32 length = XFER_MIN_DOTS + (sc_x % 8);
+
+    bool win_on = LCDC_BGW_ENABLE && window_on_line();
+    if (win_on) {
+        length += XFER_WINDOW_DOTS;
+    }
+
+    sprite_line* line = ppu_get_context()->line_sprites;
+    if (!LCDC_OBJ_ENABLE || !line) {
+        return length;
+    }
+
+    // Each sprite stalls the fetcher; the first one in a BG/window tile
+    // also waits for that tile's fetch to finish. x is sorted, so tiles
+    // already paid for are always the previous sprite's.
+    int last_tile = -1;
+    for (int i=0; i<line->count; i++) {
+        u8 x = line->x[i];
+        int tile;
+        int offset;
+        if (win_on && x > win_x) {
+            tile = 0x100 + ((x - win_x - 1) / 8);
+            offset = (x - win_x - 1) % 8;
+        } else {
+            tile = (x + sc_x) / 8;
+            offset = (x + sc_x) % 8;
         }
 
-        if(ppu_get_context()->line_sprite_count >= 10) {
-            break;
+        length += XFER_SPRITE_DOTS;
+        if (tile != last_tile && offset < XFER_SPRITE_ALIGN_DOTS) {
+            length += XFER_SPRITE_ALIGN_DOTS - offset;
         }
-        if(e.y <= cur_y + 16 && e.y + sprite_height > cur_y + 16) {
-            oam_line_entry* entry = &ppu_get_context()->line_entry_array[
-                ppu_get_context()->line_sprite_count++
-            ];
-            entry->entry = e;
-            entry->next = NULL;
-            if (!ppu_get_context()->line_sprites || ppu_get_context()->line_sprites->entry.x > e.x) {
-                entry->next = ppu_get_context()->line_sprites;
-                ppu_get_context()->line_sprites = entry;
-                continue;
-            }
+        last_tile = tile;
+    }
 
+    return length;
+}
 
-            oam_line_entry* le = ppu_get_context()->line_sprites;
-            oam_line_entry* prev = le;
-
-            while (le) {
-                if (le->entry.x > e.x) {
-                    prev->next = entry;
-                    entry->next = le;
-                    break;
-                }
-                if (!le->next) {
-                    le->next = entry;
-                    break;
-                }
-                prev = le;
-                le = le->next;
-            }
-        }
+static void ppu_hblank_start() {
+    // Lines drawn elsewhere are hashed by whoever draws them.
+    ppu_renderer renderer = ppu_get_context()->renderer;
+    if (!ppu_get_context()->skip_frame && (renderer == RENDER_FIFO || renderer == RENDER_SCANLINE)) {
+        ppu_line_done(lcd_get_context()->ly);
     }
+    LCDS_MODE_SET(MODE_HBLANK);
+
+    if (LCDS_STAT_INT(SS_HBLANK)) {
+        cpu_request_interrupt(IT_LCD_STAT);
+    }
+
+    ppu_schedule(TICKS_PER_LINE, ppu_line_end);
+}
+
+static void ppu_xfer_end(u64 ticks) {
+    ppu_get_context()->line_ticks = ticks - ppu_get_context()->line_start;
+    ppu_hblank_start();
 }
 
-void ppu_mode_oam() {
-    if (ppu_get_context()->line_ticks >= 80) {
-        LCDS_MODE_SET(MODE_XFER); 
-        ppu_get_context()->pfc.cur_fetch_state = FS_TILE;
-        ppu_get_context()->pfc.line_x = 0;
-        ppu_get_context()->pfc.fetch_x = 0;
-        ppu_get_context()->pfc.pushed_x = 0;
-        ppu_get_context()->pfc.fifo_x = 0;
+static void ppu_xfer_start(u64 ticks) {
+    ppu_get_context()->line_ticks = ticks - ppu_get_context()->line_start;
+    LCDS_MODE_SET(MODE_XFER);
+
+    if (ppu_get_context()->renderer != RENDER_FIFO) {
+        // The whole line is drawn up front, mode 3 only has to last.
+        if (ppu_get_context()->skip_frame) {
+            // Nothing to draw.
+        } else if (ppu_get_context()->renderer == RENDER_THREAD) {
+            render_queue_line();
+        } else if (ppu_get_context()->renderer == RENDER_PARALLEL) {
+            parallel_capture_line();
+        } else {
+            scanline_render();
+        }
+        ppu_schedule(XFER_START_TICK + ppu_xfer_length(), ppu_xfer_end);
+        return;
     }
 
-    if (ppu_get_context()->line_ticks == 1) {
-        ppu_get_context()->line_sprites = 0;
-        ppu_get_context()->line_sprite_count = 0;
+    ppu_get_context()->pfc.cur_fetch_state = FS_TILE;
+    ppu_get_context()->pfc.line_x = 0;
+    ppu_get_context()->pfc.fetch_x = 0;
+    ppu_get_context()->pfc.pushed_x = 0;
+    ppu_get_context()->pfc.fifo_x = 0;
 
-        load_line_sprites();
+    if (ppu_get_context()->line_sprites && !ppu_get_context()->skip_frame) {
+        sprite_overlay_build(LCDC_OBJ_HEIGHT);
     }
+
+    // Mode 3 has no fixed length, the FIFO decides when it ends.
+    ppu_get_context()->dot_active = true;
 }
 
 void ppu_mode_xfer() {
     pipeline_process();
     if (ppu_get_context()->pfc.pushed_x >= XRES) {
         pipeline_fifo_reset();
-        LCDS_MODE_SET(MODE_HBLANK); 
+        ppu_get_context()->dot_active = false;
+        ppu_hblank_start();
+    }
+}
+
+static void ppu_frame_pace() {
+    if (emu_get_context()->shadow) {
+        return;
+    }
+    if (pacer_frame(emu_get_context()->ticks)) {
+        if (cart_need_save()) {
+            cart_battery_save();
+        }
+    }
+}
+
+static void ppu_mode_hblank() {
+    increment_ly();
+    if (lcd_get_context()->ly >= YRES) {
+        LCDS_MODE_SET(MODE_VBLANK);
+        cpu_request_interrupt(IT_VBLANK);
 
-        if (LCDS_STAT_INT(SS_HBLANK)) {
+        if (LCDS_STAT_INT(SS_VBLANK)) {
             cpu_request_interrupt(IT_LCD_STAT);
         }
+        ++ppu_get_context()->current_frame;
+        if (ppu_get_context()->skip_frame || emu_get_context()->shadow) {
+            // Nothing was drawn, or nobody is watching.
+        } else if (ppu_get_context()->renderer == RENDER_THREAD) {
+            render_queue_frame();
+        } else {
+            if (ppu_get_context()->renderer == RENDER_PARALLEL) {
+                parallel_render_frame();
+            }
+            ppu_frame_done();
+        }
+
+        ppu_frame_pace();
+    } else {
+        LCDS_MODE_SET(MODE_OAM);
+    }
+}
+
+static void ppu_mode_vblank() {
+    increment_ly();
+    if (lcd_get_context()->ly >= LINES_PER_FRAME) {
+        LCDS_MODE_SET(MODE_OAM);
+        lcd_get_context()->ly = 0;
+        ppu_get_context()->window_line = 0;
+        ppu_frame_start();
     }
 }
 
-static u32 target_frame_time = 1000 / TARGET_FPS;
-static long prev_frame_time = 0;
-static long start_timer = 0;
-static long frame_count = 0;
+static void ppu_line_end(u64 ticks) {
+    if (LCDS_MODE == MODE_VBLANK) {
+        ppu_mode_vblank();
+    } else {
+        ppu_mode_hblank();
+    }
 
-void ppu_mode_hblank() {
-    if (ppu_get_context()->line_ticks >= TICKS_PER_LINE) {
-        increment_ly();
-         if (lcd_get_context()->ly >= YRES) {
-            LCDS_MODE_SET(MODE_VBLANK);
-            cpu_request_interrupt(IT_VBLANK);
+    ppu_get_context()->line_start = ticks;
+    ppu_get_context()->line_ticks = 0;
 
-            if (LCDS_STAT_INT(SS_VBLANK)) {
-                cpu_request_interrupt(IT_LCD_STAT);
-            }
-            ++ppu_get_context()->current_frame;
+    if (LCDS_MODE == MODE_OAM) {
+        ppu_schedule(OAM_SCAN_TICK, ppu_oam_scan);
+    } else {
+        ppu_schedule(TICKS_PER_LINE, ppu_line_end);
+    }
+}
 
-            // Calculate FPS
-            u32 end = get_ticks();
-            u32 frame_time = end - prev_frame_time;
+static void ppu_lcd_off_frame(u64 ticks) {
+    // Nothing is drawn while the LCD is off, but keep the frame rate steady.
+    ppu_frame_pace();
+    ppu_get_context()->line_start = ticks;
+    ppu_schedule(LINES_PER_FRAME * TICKS_PER_LINE, ppu_lcd_off_frame);
+}
 
-            if (frame_time < target_frame_time) {
-                delay((target_frame_time - frame_time));
-            }
+void ppu_sm_init() {
+    static const sched_callback callbacks[] = {
+        ppu_oam_scan, ppu_xfer_start, ppu_xfer_end, ppu_line_end, ppu_lcd_off_frame
+    };
+    sched_register(SCHED_PPU, callbacks, 5);
+}
 
-            if (end - start_timer >= 1000) {
-                u32 fps = frame_count;
-                start_timer = end;
-                frame_count = 0;
-                printf("FPS: %u\n", fps);
-                if (cart_need_save()) {
-                    cart_battery_save();
-                }
-            }
+void ppu_sm_start(u64 ticks) {
+    ppu_get_context()->line_start = ticks;
+    ppu_get_context()->line_ticks = 0;
+    ppu_get_context()->dot_active = false;
+    ppu_get_context()->window_line = 0;
+    lcd_get_context()->ly = 0;
+    LCDS_MODE_SET(MODE_OAM);
+    ppu_frame_start();
+    ppu_schedule(OAM_SCAN_TICK, ppu_oam_scan);
+}
 
-            ++frame_count;
-            prev_frame_time = get_ticks();
-        } else {
-            LCDS_MODE_SET(MODE_OAM);
-        }
-        ppu_get_context()->line_ticks = 0;
+void ppu_sm_stop(u64 ticks) {
+    if (ppu_get_context()->dot_active) {
+        pipeline_fifo_reset();
+        ppu_get_context()->dot_active = false;
+    }
+    if (ppu_get_context()->renderer == RENDER_PARALLEL) {
+        // Draw the lines of the unfinished frame.
+        parallel_render_frame();
     }
+    ppu_get_context()->line_start = ticks;
+    ppu_get_context()->line_ticks = 0;
+    ppu_get_context()->window_line = 0;
+    lcd_get_context()->ly = 0;
+    LCDS_MODE_SET(MODE_HBLANK);
+    ppu_schedule(LINES_PER_FRAME * TICKS_PER_LINE, ppu_lcd_off_frame);
 }
 
-void ppu_mode_vblank() {
-    if (ppu_get_context()->line_ticks >= TICKS_PER_LINE) {
-        increment_ly();
-        if (lcd_get_context()->ly >= LINES_PER_FRAME) {
-            LCDS_MODE_SET(MODE_OAM);
-            lcd_get_context()->ly = 0;
-            ppu_get_context()->window_line = 0;
-        }
-        ppu_get_context()->line_ticks = 0;
+void ppu_lcd_enable(bool on) {
+    if (on) {
+        ppu_sm_start(emu_get_context()->ticks);
+    } else {
+        ppu_sm_stop(emu_get_context()->ticks);
     }
 }
@@ -0,0 +1,134 @@
+#include <ppu.h>
+#include <lcd.h>
+#include <compose.h>
+#include <string.h>
+
+static sprite_index* index_get() {
+    return &ppu_get_context()->sprites;
+}
+
+static void sprite_index_mark(u8 entry, bool on) {
+    oam_entry* e = &ppu_get_context()->oam_ram[entry];
+    if (!e->x) {
+        // x == 0 sprites are never selected.
+        return;
+    }
+
+    int first = e->y - 16;
+    int last = first + index_get()->height;
+    if (first < 0) {
+        first = 0;
+    }
+    if (last > SPRITE_LINES) {
+        last = SPRITE_LINES;
+    }
+
+    for (int ly=first; ly<last; ++ly) {
+        if (on) {
+            index_get()->mask[ly] |= (1ULL << entry);
+        } else {
+            index_get()->mask[ly] &= ~(1ULL << entry);
+        }
+        index_get()->dirty[ly] = true;
+    }
+}
+
+void sprite_index_remove(u8 entry) {
+    sprite_index_mark(entry, false);
+}
+
+void sprite_index_add(u8 entry) {
+    sprite_index_mark(entry, true);
+}
+
+void sprite_index_reset() {
+    memset(index_get(), 0, sizeof(sprite_index));
+    index_get()->height = LCDC_OBJ_HEIGHT;
+    for (int i=0; i<40; ++i) {
+        sprite_index_add(i);
+    }
+}
+
+static void sprite_index_build_line(u8 ly) {
+    sprite_line* line = &index_get()->lines[ly];
+    u64 mask = index_get()->mask[ly];
+    line->count = 0;
+
+    // Lowest OAM indices win, the same as the hardware OAM scan.
+    while (mask && line->count < SPRITES_PER_LINE) {
+        u8 entry = __builtin_ctzll(mask);
+        mask &= mask - 1;
+
+        u8 x = ppu_get_context()->oam_ram[entry].x;
+        int i = line->count++;
+        while (i > 0 && line->x[i - 1] > x) {
+            line->x[i] = line->x[i - 1];
+            line->oam_index[i] = line->oam_index[i - 1];
+            --i;
+        }
+        line->x[i] = x;
+        line->oam_index[i] = entry;
+    }
+    index_get()->dirty[ly] = false;
+}
+
+sprite_line* sprite_index_line(u8 ly) {
+    if (ly >= SPRITE_LINES) {
+        return NULL;
+    }
+    if (index_get()->height != LCDC_OBJ_HEIGHT) {
+        sprite_index_reset();
+    }
+    if (index_get()->dirty[ly]) {
+        sprite_index_build_line(ly);
+    }
+    return &index_get()->lines[ly];
+}
+
+// Rasterises a line's sprites into a padded overlay buffer.
+void sprite_overlay_draw(const sprite_line* line, const oam_entry* oam, const u8* vram,
+        u8 ly, u8 sprite_height, u8* padded) {
+    u8* overlay = padded + OVERLAY_PAD;
+    int cur_y = ly;
+
+    memset(padded, 0, XRES + (OVERLAY_PAD * 2));
+
+    // Lines are sorted by x then OAM index, so the first opaque pixel
+    // written to a column is the one DMG priority picks.
+    for (int i=0; i<line->count; ++i) {
+        const oam_entry* e = &oam[line->oam_index[i]];
+
+        u8 ty = (cur_y + 16) - e->y;
+        if (e->f_y_flip) {
+            ty = (sprite_height - 1) - ty;
+        }
+        u8 tile_index = e->tile;
+        if (sprite_height == 16) {
+            tile_index &= ~(1);
+        }
+        u8 planes[2];
+        planes[0] = vram[(tile_index * 16) + (ty * 2)];
+        planes[1] = vram[(tile_index * 16) + (ty * 2) + 1];
+        u8 attr = (e->f_pn ? OVERLAY_PN : 0) | (e->f_bgp ? OVERLAY_BGP : 0);
+
+        u8 colours[8];
+        compose_decode(planes, 1, colours);
+
+        for (int b=0; b<8; ++b) {
+            int px = line->x[i] - 8 + b;
+            if (px < 0 || px >= XRES || overlay[px]) {
+                continue;
+            }
+            u8 colour = colours[e->f_x_flip ? 7 - b : b];
+            if (colour) {
+                overlay[px] = attr | colour;
+            }
+        }
+    }
+}
+
+void sprite_overlay_build(u8 sprite_height) {
+    sprite_overlay_draw(ppu_get_context()->line_sprites, ppu_get_context()->oam_ram,
+        ppu_get_context()->vram, lcd_get_context()->ly, sprite_height,
+        ppu_get_context()->sprite_overlay);
+}
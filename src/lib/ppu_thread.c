@@ -0,0 +1,129 @@
+#include <ppu_thread.h>
+#include <sched.h>
+#include <string.h>
+
+static render_context ctx = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER
+};
+
+render_context* render_get_context() {
+    return &ctx;
+}
+
+static render_record* render_queue_reserve() {
+    // Wait for the render thread to free a slot if it has fallen behind.
+    while (ctx.head - __atomic_load_n(&ctx.tail, __ATOMIC_ACQUIRE) == RENDER_QUEUE_SIZE) {
+        sched_yield();
+    }
+    return &ctx.records[ctx.head & (RENDER_QUEUE_SIZE - 1)];
+}
+
+static void render_queue_commit() {
+    // Sequentially consistent against the render thread's sleeping flag
+    // and head check: either it sees this record or we see it asleep.
+    __atomic_store_n(&ctx.head, ctx.head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx.sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ctx.lock);
+        pthread_cond_signal(&ctx.wake);
+        pthread_mutex_unlock(&ctx.lock);
+    }
+}
+
+void render_queue_write(render_op op, u16 address, u8 value) {
+    render_record* r = render_queue_reserve();
+    r->op = op;
+    r->write.address = address;
+    r->write.value = value;
+    render_queue_commit();
+}
+
+void render_queue_line() {
+    render_record* r = render_queue_reserve();
+    r->op = RQ_LINE;
+    scanline_capture(&r->line);
+    render_queue_commit();
+}
+
+void render_queue_frame() {
+    render_record* r = render_queue_reserve();
+    r->op = RQ_FRAME;
+    render_queue_commit();
+}
+
+static void render_apply(const render_record* r) {
+    switch (r->op) {
+        case RQ_VRAM:
+            ctx.vram[r->write.address - 0x8000] = r->write.value;
+            break;
+        case RQ_OAM:
+            ((u8 *)ctx.oam_ram)[r->write.address] = r->write.value;
+            break;
+        case RQ_LINE:
+            scanline_draw(&r->line, ctx.vram, ctx.oam_ram);
+            ppu_line_done(r->line.ly);
+            break;
+        case RQ_FRAME:
+            ppu_frame_done();
+            break;
+    }
+}
+
+static void* render_run(void* p) {
+    while (true) {
+        u32 head = __atomic_load_n(&ctx.head, __ATOMIC_ACQUIRE);
+        if (ctx.tail == head) {
+            // Sleep until the next record instead of spinning through
+            // pauses, LCD off frames and pacing.
+            pthread_mutex_lock(&ctx.lock);
+            __atomic_store_n(&ctx.sleeping, true, __ATOMIC_SEQ_CST);
+            bool running = __atomic_load_n(&ctx.running, __ATOMIC_SEQ_CST);
+            if (running && __atomic_load_n(&ctx.head, __ATOMIC_SEQ_CST) == head) {
+                pthread_cond_wait(&ctx.wake, &ctx.lock);
+            }
+            __atomic_store_n(&ctx.sleeping, false, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&ctx.lock);
+            if (!running) {
+                break;
+            }
+            continue;
+        }
+        while (ctx.tail != head) {
+            render_apply(&ctx.records[ctx.tail & (RENDER_QUEUE_SIZE - 1)]);
+            __atomic_store_n(&ctx.tail, ctx.tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+void render_thread_start() {
+    // The render thread starts from the emulation thread's current memory.
+    memcpy(ctx.vram, ppu_get_context()->vram, sizeof(ctx.vram));
+    memcpy(ctx.oam_ram, ppu_get_context()->oam_ram, sizeof(ctx.oam_ram));
+    ctx.head = ctx.tail = 0;
+    ctx.running = true;
+    if (pthread_create(&ctx.thread, NULL, render_run, NULL) != 0) {
+        fprintf(stderr, "Failed to create render thread\n");
+        exit(-9);
+    }
+}
+
+void render_thread_resync() {
+    // An empty queue means the render thread is done with its copies.
+    while (__atomic_load_n(&ctx.tail, __ATOMIC_ACQUIRE) != ctx.head) {
+        sched_yield();
+    }
+    memcpy(ctx.vram, ppu_get_context()->vram, sizeof(ctx.vram));
+    memcpy(ctx.oam_ram, ppu_get_context()->oam_ram, sizeof(ctx.oam_ram));
+}
+
+void render_thread_stop() {
+    if (!ctx.running) {
+        return;
+    }
+    pthread_mutex_lock(&ctx.lock);
+    __atomic_store_n(&ctx.running, false, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&ctx.wake);
+    pthread_mutex_unlock(&ctx.lock);
+    pthread_join(ctx.thread, NULL);
+}
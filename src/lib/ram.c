@@ -1,12 +1,11 @@
 #include <ram.h>
 
-typedef struct {
-    u8 wram[0x2000]; // 8KB Work RAM
-    u8 hram[0x80]; // 2KB High RAM
-} ram_context;
-
 static ram_context ctx;
 
+ram_context* ram_get_context() {
+    return &ctx;
+}
+
 u8 wram_read(u16 address) {
     address -= 0xC000;
     if (address >= 0x2000) {
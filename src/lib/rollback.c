@@ -0,0 +1,554 @@
+#include <rollback.h>
+#include <state.h>
+#include <link.h>
+#include <emu.h>
+#include <cpu.h>
+#include <ppu.h>
+#include <apu.h>
+#include <cart.h>
+#include <joypad.h>
+#include <serial.h>
+#include <bootrom.h>
+#include <scheduler.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define ROLLBACK_MAGIC 0x42524D47 // "GMRB"
+#define ROLLBACK_VERSION 1
+#define INPUT_RING 64       // frames of input kept, more than either side can lead by
+#define JOIN_TRIES 100      // a joining player waits up to 10 s for the host
+#define JOIN_RETRY_MS 100
+#define STALL_POLL_MS 5
+#define NO_REPLAY ((u64)-1)
+#define SC_TRANSFER (1 << 7)
+#define CART_RAM_MAX (16 * 0x2000)
+
+// Sent by each side on connecting, followed by its cartridge RAM.
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 rom_hash;
+    u64 boot_hash; // 0 without a boot ROM
+    u32 cart_ram_size;
+} rollback_hello;
+
+// One machine's save state, and its SC register for the frame loop.
+typedef struct {
+    size_t size;
+    u8 sc;
+    _Alignas(8) u8 data[STATE_MAX_SIZE];
+} machine_state;
+
+// Both machines and the cable between them at the start of a frame.
+typedef struct {
+    machine_state m[2];
+    link_pair_state link;
+} rollback_snapshot;
+
+typedef struct {
+    int fd;
+    int self;   // machine of the local player, 0 for the host
+    int loaded; // machine the modules hold now; live[loaded] is stale
+    bool synth; // whether the local machine's sound is synthesised
+
+    machine_state live[2];
+    rollback_snapshot ring[ROLLBACK_MAX_FRAMES];
+
+    u8 local_in[INPUT_RING];
+    u8 remote_in[INPUT_RING]; // received, for frames below confirmed
+    u8 used_in[INPUT_RING];   // remote input each frame was last run with
+    u64 frame;       // next frame to run
+    u64 confirmed;   // remote input is known below this frame
+    u64 replay_from; // earliest frame run with a wrong prediction
+
+    u8 peer_ram[CART_RAM_MAX];
+    u32 peer_ram_size;
+
+    rollback_stats stats;
+    rollback_stats reported; // stats at the last report
+    u32 depth_max;           // maxima since the last report
+    u64 replay_ns_max;
+    u64 report_ns;
+    bool stalled;
+} rollback_context;
+
+static rollback_context ctx = { .fd = -1 };
+
+rollback_stats* rollback_get_stats() {
+    return &ctx.stats;
+}
+
+bool rollback_active() {
+    return ctx.fd >= 0;
+}
+
+static u64 rollback_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static u64 rollback_hash(const u8* data, u32 size) {
+    u64 h = 1469598103934665603ULL;
+    for (u32 i=0; i<size; i++) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static bool send_all(const void* data, size_t size) {
+    const u8* p = data;
+    while (size) {
+        ssize_t n = send(ctx.fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool recv_all(void* data, size_t size) {
+    u8* p = data;
+    while (size) {
+        ssize_t n = recv(ctx.fd, p, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// ---- connecting ----
+
+static int rollback_socket(const char* addr, struct sockaddr_storage* sa, socklen_t* len) {
+    char* end;
+    long port = strtol(addr, &end, 10);
+    memset(sa, 0, sizeof(*sa));
+    if (*addr && !*end) {
+        if (port <= 0 || port > 65535) {
+            return -1;
+        }
+        struct sockaddr_in* in = (struct sockaddr_in*)sa;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *len = sizeof(*in);
+        return socket(AF_INET, SOCK_STREAM, 0);
+    }
+    struct sockaddr_un* un = (struct sockaddr_un*)sa;
+    if (strlen(addr) >= sizeof(un->sun_path)) {
+        return -1;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, addr);
+    *len = sizeof(*un);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+static int rollback_listen(const char* addr) {
+    struct sockaddr_storage sa;
+    socklen_t len;
+    int fd = rollback_socket(addr, &sa, &len);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (sa.ss_family == AF_UNIX) {
+        unlink(addr);
+    }
+    if (bind(fd, (struct sockaddr*)&sa, len) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    printf("Rollback: waiting for player 2 on %s\n", addr);
+    int peer = accept(fd, NULL, NULL);
+    close(fd);
+    if (sa.ss_family == AF_UNIX) {
+        unlink(addr);
+    }
+    return peer;
+}
+
+static int rollback_join(const char* addr) {
+    for (int i=0; i<JOIN_TRIES; i++) {
+        struct sockaddr_storage sa;
+        socklen_t len;
+        int fd = rollback_socket(addr, &sa, &len);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr*)&sa, len) == 0) {
+            return fd;
+        }
+        close(fd);
+        delay(JOIN_RETRY_MS);
+    }
+    return -1;
+}
+
+static void rollback_hello_fill(rollback_hello* h) {
+    cart_context* cart = cart_get_context();
+    bootrom_ctx* boot = bootrom_get();
+    h->magic = ROLLBACK_MAGIC;
+    h->version = ROLLBACK_VERSION;
+    h->rom_hash = rollback_hash(cart->rom_data, cart->rom_size);
+    h->boot_hash = boot->loaded ? rollback_hash(boot->data, boot->size) : 0;
+    h->cart_ram_size = 0;
+    for (int i=0; i<16; i++) {
+        if (cart->ram_banks[i]) {
+            h->cart_ram_size += 0x2000;
+        }
+    }
+}
+
+static bool rollback_send_hello() {
+    rollback_hello h;
+    rollback_hello_fill(&h);
+    if (!send_all(&h, sizeof(h))) {
+        return false;
+    }
+    cart_context* cart = cart_get_context();
+    for (int i=0; i<16; i++) {
+        if (cart->ram_banks[i] && !send_all(cart->ram_banks[i], 0x2000)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool rollback_recv_hello() {
+    rollback_hello ours, h;
+    rollback_hello_fill(&ours);
+    if (!recv_all(&h, sizeof(h))) {
+        return false;
+    }
+    if (h.magic != ROLLBACK_MAGIC || h.version != ours.version) {
+        fprintf(stderr, "Rollback: peer speaks another protocol\n");
+        return false;
+    }
+    if (h.rom_hash != ours.rom_hash || h.boot_hash != ours.boot_hash) {
+        fprintf(stderr, "Rollback: peer runs a different ROM or boot ROM\n");
+        return false;
+    }
+    if (h.cart_ram_size != ours.cart_ram_size) {
+        return false;
+    }
+    ctx.peer_ram_size = h.cart_ram_size;
+    return recv_all(ctx.peer_ram, ctx.peer_ram_size);
+}
+
+bool rollback_connect(const char* addr, bool host) {
+    ctx.fd = host ? rollback_listen(addr) : rollback_join(addr);
+    if (ctx.fd < 0) {
+        fprintf(stderr, "Rollback: could not connect on %s\n", addr);
+        return false;
+    }
+    int on = 1;
+    setsockopt(ctx.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // fails harmlessly on Unix sockets
+
+    // The host goes first, so neither side blocks sending its RAM into a
+    // full socket buffer.
+    bool ok = host ? rollback_send_hello() && rollback_recv_hello()
+                   : rollback_recv_hello() && rollback_send_hello();
+    if (!ok) {
+        close(ctx.fd);
+        ctx.fd = -1;
+        return false;
+    }
+    fcntl(ctx.fd, F_SETFL, fcntl(ctx.fd, F_GETFL) | O_NONBLOCK);
+    ctx.self = host ? 0 : 1;
+    link_pair();
+    printf("Rollback: connected as player %d\n", ctx.self + 1);
+    return true;
+}
+
+// ---- machines ----
+
+static void machine_save(machine_state* s) {
+    s->size = state_save(s->data, STATE_MAX_SIZE);
+    s->sc = serial_get_context()->sc;
+}
+
+// The session keeps its synth setting across loads, so it is set first.
+static void machine_load(const machine_state* s, int m) {
+    apu_get_state()->synth = m == ctx.self && ctx.synth;
+    state_load(s->data, s->size);
+}
+
+static void machine_copy(machine_state* to, const machine_state* from) {
+    to->size = from->size;
+    to->sc = from->sc;
+    memcpy(to->data, from->data, from->size);
+}
+
+// Makes machine m the one the modules hold. Only the local machine is
+// paced, heard and presented, and only when not replaying. A replayed
+// frame is drawn only if the frame after it is not replayed too, as the
+// picture being drawn when the replay ends may have started there.
+static void machine_use(int m, bool replay, bool drawn) {
+    if (m != ctx.loaded) {
+        machine_save(&ctx.live[ctx.loaded]);
+        machine_load(&ctx.live[m], m);
+        ctx.loaded = m;
+        link_select(m);
+    }
+    emu_get_context()->headless = !drawn || m != ctx.self;
+    emu_get_context()->shadow = replay || m != ctx.self;
+}
+
+static u8 machine_sc(int m) {
+    return m == ctx.loaded ? serial_get_context()->sc : ctx.live[m].sc;
+}
+
+// Both machines start as the local one did, the remote one with the
+// peer's cartridge RAM, no sound synthesis and nothing drawn.
+static void machine_setup() {
+    ctx.synth = apu_get_state()->synth;
+    machine_save(&ctx.live[ctx.self]);
+
+    cart_context* cart = cart_get_context();
+    u32 at = 0;
+    for (int i=0; i<16 && at < ctx.peer_ram_size; i++) {
+        if (cart->ram_banks[i]) {
+            memcpy(cart->ram_banks[i], ctx.peer_ram + at, 0x2000);
+            at += 0x2000;
+        }
+    }
+    apu_get_state()->synth = false;
+    sched_cancel(SCHED_APU);
+    ppu_get_context()->skip_frame = true;
+    machine_save(&ctx.live[!ctx.self]);
+
+    machine_load(&ctx.live[ctx.self], ctx.self);
+    ctx.loaded = ctx.self;
+    link_select(ctx.self);
+}
+
+// ---- frames ----
+
+static u8 remote_input(u64 frame) {
+    if (frame < ctx.confirmed) {
+        return ctx.remote_in[frame % INPUT_RING];
+    }
+    return ctx.confirmed ? ctx.remote_in[(ctx.confirmed - 1) % INPUT_RING] : 0;
+}
+
+static void snapshot_take(u64 frame) {
+    u64 start = rollback_now();
+    rollback_snapshot* s = &ctx.ring[frame % ROLLBACK_MAX_FRAMES];
+    for (int m=0; m<2; m++) {
+        if (m == ctx.loaded) {
+            machine_save(&s->m[m]);
+        } else {
+            machine_copy(&s->m[m], &ctx.live[m]);
+        }
+    }
+    s->link = *link_pair_get_state();
+    ctx.stats.snapshots++;
+    ctx.stats.snapshot_ns_total += rollback_now() - start;
+}
+
+static void snapshot_restore(u64 frame) {
+    rollback_snapshot* s = &ctx.ring[frame % ROLLBACK_MAX_FRAMES];
+    for (int m=0; m<2; m++) {
+        if (m == ctx.loaded) {
+            machine_load(&s->m[m], m);
+        } else {
+            machine_copy(&ctx.live[m], &s->m[m]);
+        }
+    }
+    *link_pair_get_state() = s->link;
+}
+
+// Runs both machines through one frame. They take turns a frame at a
+// time, or a byte's time while either has a transfer going.
+static bool rollback_frame(u64 frame, bool replay) {
+    bool drawn = !replay || frame + 1 == ctx.frame;
+    u8 in[2];
+    in[ctx.self] = ctx.local_in[frame % INPUT_RING];
+    in[!ctx.self] = remote_input(frame);
+    ctx.used_in[frame % INPUT_RING] = in[!ctx.self];
+
+    u64 at = frame * ROLLBACK_FRAME_TICKS;
+    u64 end = at + ROLLBACK_FRAME_TICKS;
+    while (at < end) {
+        u64 until = end;
+        if (((machine_sc(0) | machine_sc(1)) & SC_TRANSFER) && at + SERIAL_BYTE_TICKS < end) {
+            until = at + SERIAL_BYTE_TICKS;
+        }
+        for (int m=0; m<2; m++) {
+            machine_use(m, replay, drawn);
+            if (at == frame * ROLLBACK_FRAME_TICKS) {
+                joypad_feed(in[m]);
+            }
+            while (emu_get_context()->ticks < until) {
+                if (!cpu_step()) {
+                    return false;
+                }
+            }
+        }
+        at = until;
+    }
+    return true;
+}
+
+static bool rollback_replay() {
+    u64 from = ctx.replay_from;
+    ctx.replay_from = NO_REPLAY;
+    u64 start = rollback_now();
+
+    snapshot_restore(from);
+    for (u64 f=from; f<ctx.frame; f++) {
+        if (f != from) {
+            snapshot_take(f);
+        }
+        if (!rollback_frame(f, true)) {
+            return false;
+        }
+    }
+
+    u32 depth = ctx.frame - from;
+    u64 ns = rollback_now() - start;
+    ctx.stats.rollbacks++;
+    ctx.stats.depth_total += depth;
+    ctx.stats.replay_ns_total += ns;
+    if (depth > ctx.stats.depth_max) {
+        ctx.stats.depth_max = depth;
+    }
+    if (ns > ctx.stats.replay_ns_max) {
+        ctx.stats.replay_ns_max = ns;
+    }
+    if (depth > ctx.depth_max) {
+        ctx.depth_max = depth;
+    }
+    if (ns > ctx.replay_ns_max) {
+        ctx.replay_ns_max = ns;
+    }
+    return true;
+}
+
+// Takes in every remote input that has arrived. False once the peer left.
+static bool rollback_receive() {
+    u8 buf[256];
+    for (;;) {
+        ssize_t n = recv(ctx.fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        for (ssize_t i=0; i<n; i++) {
+            u64 f = ctx.confirmed++;
+            ctx.remote_in[f % INPUT_RING] = buf[i];
+            if (f < ctx.frame && ctx.used_in[f % INPUT_RING] != buf[i] && f < ctx.replay_from) {
+                ctx.replay_from = f;
+            }
+        }
+    }
+}
+
+static void rollback_report() {
+    u64 now = rollback_now();
+    if (now - ctx.report_ns < 1000000000ULL) {
+        return;
+    }
+    rollback_stats* s = &ctx.stats;
+    rollback_stats* r = &ctx.reported;
+    u64 rollbacks = s->rollbacks - r->rollbacks;
+    u64 snapshots = s->snapshots - r->snapshots;
+    double seconds = (now - ctx.report_ns) / 1e9;
+    printf("Rollback: %llu rollbacks, depth avg %.1f max %u, replay avg %.2f ms max %.2f ms, "
+        "%.0f snapshots/s avg %.1f us, %llu stalls\n",
+        (unsigned long long)rollbacks,
+        rollbacks ? (double)(s->depth_total - r->depth_total) / rollbacks : 0.0, ctx.depth_max,
+        rollbacks ? (s->replay_ns_total - r->replay_ns_total) / 1e6 / rollbacks : 0.0,
+        ctx.replay_ns_max / 1e6,
+        snapshots / seconds,
+        snapshots ? (s->snapshot_ns_total - r->snapshot_ns_total) / 1e3 / snapshots : 0.0,
+        (unsigned long long)(s->stalls - r->stalls));
+    ctx.reported = *s;
+    ctx.depth_max = 0;
+    ctx.replay_ns_max = 0;
+    ctx.report_ns = now;
+}
+
+void rollback_run() {
+    emu_context* emu = emu_get_context();
+    machine_setup();
+    ctx.replay_from = NO_REPLAY;
+    ctx.report_ns = rollback_now();
+
+    bool peer = true;
+    while (emu->running) {
+        peer = rollback_receive();
+        if (!peer) {
+            break;
+        }
+        if (ctx.replay_from != NO_REPLAY && !rollback_replay()) {
+            break;
+        }
+        if (emu->paused) {
+            delay(10);
+            continue;
+        }
+        if (ctx.frame >= ctx.confirmed + ROLLBACK_MAX_FRAMES) {
+            // Too far ahead to roll back, wait for the peer.
+            if (!ctx.stalled) {
+                ctx.stalled = true;
+                ctx.stats.stalls++;
+            }
+            struct pollfd p = { .fd = ctx.fd, .events = POLLIN };
+            poll(&p, 1, STALL_POLL_MS);
+            continue;
+        }
+        ctx.stalled = false;
+
+        u8 in = joypad_buttons();
+        ctx.local_in[ctx.frame % INPUT_RING] = in;
+        if (!send_all(&in, 1)) {
+            peer = false;
+            break;
+        }
+        snapshot_take(ctx.frame);
+        if (!rollback_frame(ctx.frame, false)) {
+            break;
+        }
+        ctx.frame++;
+        ctx.stats.frames++;
+        rollback_report();
+    }
+
+    machine_use(ctx.self, false, true);
+    emu->shadow = false;
+    emu->headless = false;
+    close(ctx.fd);
+    ctx.fd = -1;
+    if (!peer) {
+        printf("Rollback: player %d left\n", 2 - ctx.self);
+        emu->die = true;
+    }
+}
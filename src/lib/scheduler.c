@@ -0,0 +1,75 @@
+#include <scheduler.h>
+
+static sched_context ctx;
+
+static struct {
+    const sched_callback* callbacks;
+    u8 count;
+} known[SCHED_EVENT_COUNT];
+
+sched_context* sched_get_context() {
+    return &ctx;
+}
+
+static void sched_update_next() {
+    ctx.next = SCHED_NEVER;
+    for (int i=0; i<SCHED_EVENT_COUNT; ++i) {
+        if (ctx.events[i].when < ctx.next) {
+            ctx.next = ctx.events[i].when;
+        }
+    }
+}
+
+void sched_init() {
+    for (int i=0; i<SCHED_EVENT_COUNT; ++i) {
+        ctx.events[i].when = SCHED_NEVER;
+        ctx.events[i].callback = NULL;
+    }
+    ctx.next = SCHED_NEVER;
+}
+
+void sched_add(sched_event ev, u64 when, sched_callback callback) {
+    ctx.events[ev].when = when;
+    ctx.events[ev].callback = callback;
+    sched_update_next();
+}
+
+void sched_cancel(sched_event ev) {
+    ctx.events[ev].when = SCHED_NEVER;
+    sched_update_next();
+}
+
+bool sched_pending(sched_event ev) {
+    return ctx.events[ev].when != SCHED_NEVER;
+}
+
+void sched_run(u64 ticks) {
+    while (ctx.next <= ticks) {
+        for (int i=0; i<SCHED_EVENT_COUNT; ++i) {
+            if (ctx.events[i].when <= ticks) {
+                u64 when = ctx.events[i].when;
+                ctx.events[i].when = SCHED_NEVER;
+                ctx.events[i].callback(when);
+            }
+        }
+        sched_update_next();
+    }
+}
+
+void sched_register(sched_event ev, const sched_callback* callbacks, u8 count) {
+    known[ev].callbacks = callbacks;
+    known[ev].count = count;
+}
+
+u8 sched_callback_index(sched_event ev, sched_callback callback) {
+    for (u8 i=0; i<known[ev].count; ++i) {
+        if (known[ev].callbacks[i] == callback) {
+            return i;
+        }
+    }
+    return SCHED_NO_CALLBACK;
+}
+
+sched_callback sched_callback_at(sched_event ev, u8 index) {
+    return index < known[ev].count ? known[ev].callbacks[index] : NULL;
+}
@@ -0,0 +1,86 @@
+#include <serial.h>
+#include <link.h>
+#include <scheduler.h>
+#include <interrupts.h>
+#include <emu.h>
+#include <dbg.h>
+
+static serial_context ctx;
+
+#define SC_TRANSFER (1 << 7)
+#define SC_INTERNAL (1 << 0)
+
+serial_context* serial_get_context() {
+    return &ctx;
+}
+
+static void serial_finish(u8 in) {
+    ctx.sb = in;
+    ctx.sc &= ~SC_TRANSFER;
+    cpu_request_interrupt(IT_SERIAL);
+}
+
+static void serial_done(u64 ticks) {
+    serial_finish(link_transfer(ctx.sb, ticks));
+}
+
+// Runs once per bit period while linked: publishes the time the peer may
+// be waiting on and answers its transfers.
+static void serial_link_tick(u64 ticks) {
+    link_sync(ticks);
+    u8 in;
+    if ((ctx.sc & (SC_TRANSFER | SC_INTERNAL)) == SC_TRANSFER && link_poll(ctx.sb, &in, ticks)) {
+        serial_finish(in);
+    }
+    if (link_connected()) {
+        sched_add(SCHED_LINK, ticks + SERIAL_BIT_TICKS, serial_link_tick);
+    }
+}
+
+void serial_init() {
+    static const sched_callback serial_callbacks[] = { serial_done };
+    static const sched_callback link_callbacks[] = { serial_link_tick };
+    sched_register(SCHED_SERIAL, serial_callbacks, 1);
+    sched_register(SCHED_LINK, link_callbacks, 1);
+    ctx.sb = 0;
+    ctx.sc = 0;
+    sched_cancel(SCHED_SERIAL);
+    if (link_connected()) {
+        serial_link_tick(emu_get_context()->ticks);
+    }
+}
+
+u8 serial_read(u16 address) {
+    if (address == 0xFF01) {
+        return ctx.sb;
+    }
+    return ctx.sc | 0x7E; // unused bits read 1
+}
+
+void serial_write(u16 address, u8 value) {
+    if (address == 0xFF01) {
+        ctx.sb = value;
+        if ((ctx.sc & (SC_TRANSFER | SC_INTERNAL)) == SC_TRANSFER) {
+            link_arm(true, ctx.sb); // the peer may take the new byte
+        }
+        return;
+    }
+    // Rewriting SC drops the transfer in progress.
+    if (ctx.sc & SC_TRANSFER) {
+        if (ctx.sc & SC_INTERNAL) {
+            sched_cancel(SCHED_SERIAL);
+        } else {
+            link_arm(false, ctx.sb);
+        }
+    }
+    ctx.sc = value & (SC_TRANSFER | SC_INTERNAL);
+    if (!(ctx.sc & SC_TRANSFER)) {
+        return;
+    }
+    if (ctx.sc & SC_INTERNAL) {
+        dbg_serial(ctx.sb);
+        sched_add(SCHED_SERIAL, emu_get_context()->ticks + SERIAL_BYTE_TICKS, serial_done);
+    } else {
+        link_arm(true, ctx.sb);
+    }
+}
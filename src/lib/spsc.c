@@ -0,0 +1,97 @@
+#include <spsc.h>
+#include <string.h>
+
+void frame_ring_init(frame_ring* r, int16_t* frames, u32 size) {
+    r->frames = frames;
+    r->size = size;
+    r->head = r->tail = 0;
+}
+
+u32 frame_ring_fill(frame_ring* r) {
+    u32 tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+u32 frame_ring_write(frame_ring* r, const int16_t* frames, u32 n) {
+    u32 head = r->head;
+    u32 space = r->size - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    if (n > space) {
+        n = space;
+    }
+
+    u32 at = head & (r->size - 1);
+    u32 first = n < r->size - at ? n : r->size - at;
+    memcpy(&r->frames[at * 2], frames, first * 2 * sizeof(int16_t));
+    memcpy(r->frames, frames + first * 2, (n - first) * 2 * sizeof(int16_t));
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+u32 frame_ring_peek(frame_ring* r, const int16_t* piece[2], u32 count[2]) {
+    u32 tail = r->tail;
+    u32 n = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+    u32 at = tail & (r->size - 1);
+    count[0] = n < r->size - at ? n : r->size - at;
+    count[1] = n - count[0];
+    piece[0] = &r->frames[at * 2];
+    piece[1] = r->frames;
+    return n;
+}
+
+void frame_ring_consume(frame_ring* r, u32 n) {
+    __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
+
+u32 frame_ring_read(frame_ring* r, int16_t* frames, u32 n) {
+    const int16_t* piece[2];
+    u32 count[2];
+    u32 avail = frame_ring_peek(r, piece, count);
+    if (n > avail) {
+        n = avail;
+    }
+
+    u32 first = n < count[0] ? n : count[0];
+    memcpy(frames, piece[0], first * 2 * sizeof(int16_t));
+    memcpy(frames + first * 2, piece[1], (n - first) * 2 * sizeof(int16_t));
+    frame_ring_consume(r, n);
+    return n;
+}
+
+void worker_start(worker* w, void* (*run)(void*), const char* name) {
+    w->running = true;
+    if (pthread_create(&w->thread, NULL, run, NULL) != 0) {
+        fprintf(stderr, "Failed to create %s thread\n", name);
+        exit(-9);
+    }
+}
+
+void worker_stop(worker* w) {
+    if (!w->running) {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    __atomic_store_n(&w->running, false, __ATOMIC_RELEASE);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+}
+
+void worker_wake(worker* w) {
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+bool worker_wait(worker* w, bool (*idle)(void)) {
+    pthread_mutex_lock(&w->lock);
+    bool running = __atomic_load_n(&w->running, __ATOMIC_ACQUIRE);
+    if (running && idle()) {
+        pthread_cond_wait(&w->wake, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return running;
+}
+
+bool worker_running(worker* w) {
+    return w->running;
+}
@@ -0,0 +1,481 @@
+#include <state.h>
+#include <emu.h>
+#include <cpu.h>
+#include <scheduler.h>
+#include <timer.h>
+#include <serial.h>
+#include <dma.h>
+#include <lcd.h>
+#include <ppu.h>
+#include <ram.h>
+#include <joypad.h>
+#include <cart.h>
+#include <apu.h>
+#include <blip.h>
+#include <bootrom.h>
+#include <string.h>
+#include <stddef.h>
+
+#define ID(a, b, c, d) ((u32)(a) | (u32)(b) << 8 | (u32)(c) << 16 | (u32)(d) << 24)
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 size;     // whole state
+    u32 sections;
+} state_header;
+
+typedef struct {
+    u32 id;
+    u32 size; // payload, without padding
+} state_section;
+
+typedef enum {
+    SEC_EMU, SEC_CPU, SEC_SCHD, SEC_TIMR, SEC_SERL, SEC_DMA, SEC_LCD, SEC_PPU,
+    SEC_RAM, SEC_JOYP, SEC_BOOT, SEC_CART, SEC_APU, SEC_BLIP, SEC_COUNT
+} section;
+
+static const u32 section_ids[SEC_COUNT] = {
+    ID('E','M','U',' '), ID('C','P','U',' '), ID('S','C','H','D'), ID('T','I','M','R'),
+    ID('S','E','R','L'), ID('D','M','A',' '), ID('L','C','D',' '), ID('P','P','U',' '),
+    ID('R','A','M',' '), ID('J','O','Y','P'), ID('B','O','O','T'), ID('C','A','R','T'),
+    ID('A','P','U',' '), ID('B','L','I','P')
+};
+
+typedef struct {
+    u64 when;
+    u8 callback; // index from sched_callback_index, SCHED_NO_CALLBACK when idle
+    u8 pad[7];
+} sched_saved;
+
+// Follows ppu_context's state part.
+typedef struct {
+    bool has_line_sprites;
+    u8 line_sprites; // line of sprites.lines it points at
+    u8 fifo_size;
+    u8 fifo[STATE_FIFO_MAX]; // values, unused while the frame is skipped
+} ppu_saved;
+
+// Followed by ram_banks banks of cartridge RAM, in bank order.
+typedef struct {
+    u16 global_checksum; // of the cartridge the state is for
+    u8 checksum;
+    u8 type;
+    bool ram_enabled;
+    bool ram_banking;
+    u8 banking_mode;
+    u8 rom_bank_value;
+    u8 ram_bank_value;
+    bool need_save;
+    u8 ram_bank;  // index into ram_banks, 0xFF for none
+    u8 ram_banks;
+    u32 rom_bank; // rom_bank_x - rom_data
+} cart_saved;
+
+// Followed by used entries of buf, for each of the two buffers.
+typedef struct {
+    u64 factor;
+    u64 offset;
+    int32_t integrator;
+    u32 used;
+} blip_saved;
+
+// The APU copy is saved around its step buffers.
+#define APU_HEAD offsetof(apu_state, blip_l)
+#define APU_TAIL_AT offsetof(apu_state, level)
+#define APU_TAIL (sizeof(apu_state) - APU_TAIL_AT)
+
+static u8 cart_ram_banks() {
+    u8 n = 0;
+    for (int i=0; i<16; i++) {
+        n += cart_get_context()->ram_banks[i] != NULL;
+    }
+    return n;
+}
+
+// ---- saving ----
+
+typedef struct {
+    u8* buf;
+    size_t cap;
+    size_t at;
+    u32 sections;
+} state_writer;
+
+// Reserves a section, returns where its payload goes or NULL when full.
+static u8* section_add(state_writer* w, section sec, size_t size) {
+    size_t end = w->at + sizeof(state_section) + ALIGN8(size);
+    if (!w->buf || end > w->cap) {
+        w->buf = NULL;
+        return NULL;
+    }
+    state_section* s = (state_section*)(w->buf + w->at);
+    s->id = section_ids[sec];
+    s->size = size;
+    u8* payload = w->buf + w->at + sizeof(state_section);
+    memset(payload + size, 0, ALIGN8(size) - size);
+    w->at = end;
+    w->sections++;
+    return payload;
+}
+
+static void section_put(state_writer* w, section sec, const void* data, size_t size) {
+    u8* p = section_add(w, sec, size);
+    if (p) {
+        memcpy(p, data, size);
+    }
+}
+
+static void save_cpu(state_writer* w) {
+    u8* p = section_add(w, SEC_CPU, sizeof(cpu_context));
+    if (p) {
+        memcpy(p, cpu_get_context(), sizeof(cpu_context));
+        memset(p + offsetof(cpu_context, curr_inst), 0, sizeof(instruction*));
+    }
+}
+
+static void save_sched(state_writer* w) {
+    sched_saved* p = (sched_saved*)section_add(w, SEC_SCHD, sizeof(sched_saved) * SCHED_EVENT_COUNT);
+    if (!p) {
+        return;
+    }
+    memset(p, 0, sizeof(sched_saved) * SCHED_EVENT_COUNT);
+    for (int i=0; i<SCHED_EVENT_COUNT; i++) {
+        sched_entry* e = &sched_get_context()->events[i];
+        p[i].when = e->when;
+        p[i].callback = sched_pending(i) ? sched_callback_index(i, e->callback) : SCHED_NO_CALLBACK;
+    }
+}
+
+static void save_ppu(state_writer* w) {
+    u8* p = section_add(w, SEC_PPU, PPU_STATE_SIZE + sizeof(ppu_saved));
+    if (!p) {
+        return;
+    }
+    ppu_context* ppu = ppu_get_context();
+    memcpy(p, ppu, PPU_STATE_SIZE);
+    memset(p + offsetof(ppu_context, line_sprites), 0, sizeof(sprite_line*));
+    memset(p + offsetof(ppu_context, pfc.pixel_fifo.head), 0, sizeof(fifo_entry*) * 2);
+
+    ppu_saved* extra = (ppu_saved*)(p + PPU_STATE_SIZE);
+    memset(extra, 0, sizeof(*extra));
+    extra->has_line_sprites = ppu->line_sprites != NULL;
+    extra->line_sprites = ppu->line_sprites ? ppu->line_sprites - ppu->sprites.lines : 0;
+    extra->fifo_size = ppu->pfc.pixel_fifo.size;
+    int i = 0;
+    for (fifo_entry* e = ppu->pfc.pixel_fifo.head; e && i < STATE_FIFO_MAX; e = e->next) {
+        extra->fifo[i++] = e->value;
+    }
+}
+
+static void save_cart(state_writer* w) {
+    cart_context* cart = cart_get_context();
+    u8 banks = cart_ram_banks();
+    cart_saved* p = (cart_saved*)section_add(w, SEC_CART, sizeof(cart_saved) + banks * 0x2000);
+    if (!p) {
+        return;
+    }
+    memset(p, 0, sizeof(*p));
+    p->global_checksum = cart->header->global_checksum;
+    p->checksum = cart->header->checksum;
+    p->type = cart->header->type;
+    p->ram_enabled = cart->ram_enabled;
+    p->ram_banking = cart->ram_banking;
+    p->banking_mode = cart->banking_mode;
+    p->rom_bank_value = cart->rom_bank_value;
+    p->ram_bank_value = cart->ram_bank_value;
+    p->need_save = cart->need_save;
+    p->ram_bank = 0xFF;
+    p->ram_banks = banks;
+    p->rom_bank = cart->rom_bank_x - cart->rom_data;
+
+    u8* ram = (u8*)(p + 1);
+    for (int i=0; i<16; i++) {
+        if (cart->ram_banks[i] && cart->ram_banks[i] == cart->ram_bank) {
+            p->ram_bank = i;
+        }
+        if (cart->ram_banks[i]) {
+            memcpy(ram, cart->ram_banks[i], 0x2000);
+            ram += 0x2000;
+        }
+    }
+}
+
+static void save_apu(state_writer* w) {
+    apu_state* apu = apu_get_state();
+    u8* p = section_add(w, SEC_APU, APU_HEAD + APU_TAIL);
+    if (p) {
+        memcpy(p, apu, APU_HEAD);
+        memcpy(p + APU_HEAD, (u8*)apu + APU_TAIL_AT, APU_TAIL);
+    }
+    if (!apu->synth) {
+        return;
+    }
+
+    u32 clocks = apu->ticks - apu->frame_start;
+    blip_buffer* blips[2] = { &apu->blip_l, &apu->blip_r };
+    u32 used[2] = { blip_used(blips[0], clocks), blip_used(blips[1], clocks) };
+    size_t size = 2 * sizeof(blip_saved) + (used[0] + used[1]) * sizeof(int32_t);
+    p = section_add(w, SEC_BLIP, size);
+    for (int i=0; p && i<2; i++) {
+        blip_saved* b = (blip_saved*)p;
+        b->factor = blips[i]->factor;
+        b->offset = blips[i]->offset;
+        b->integrator = blips[i]->integrator;
+        b->used = used[i];
+        memcpy(b + 1, blips[i]->buf, used[i] * sizeof(int32_t));
+        p += sizeof(blip_saved) + used[i] * sizeof(int32_t);
+    }
+}
+
+size_t state_save(u8* buf, size_t cap) {
+    state_writer w = { .buf = buf, .cap = cap, .at = sizeof(state_header) };
+    if (cap < sizeof(state_header)) {
+        return 0;
+    }
+
+    section_put(&w, SEC_EMU, &emu_get_context()->ticks, sizeof(u64));
+    save_cpu(&w);
+    save_sched(&w);
+    section_put(&w, SEC_TIMR, timer_get_context(), sizeof(timer_context));
+    section_put(&w, SEC_SERL, serial_get_context(), sizeof(serial_context));
+    section_put(&w, SEC_DMA, dma_get_context(), sizeof(dma_context));
+    section_put(&w, SEC_LCD, lcd_get_context(), sizeof(lcd_context));
+    save_ppu(&w);
+    section_put(&w, SEC_RAM, ram_get_context(), sizeof(ram_context));
+    section_put(&w, SEC_JOYP, joypad_get_context(), sizeof(joypad_context));
+    section_put(&w, SEC_BOOT, &bootrom_get()->enabled, sizeof(bool));
+    save_cart(&w);
+    save_apu(&w);
+    if (!w.buf) {
+        return 0;
+    }
+
+    state_header* h = (state_header*)buf;
+    h->magic = STATE_MAGIC;
+    h->version = STATE_VERSION;
+    h->size = w.at;
+    h->sections = w.sections;
+    return w.at;
+}
+
+// ---- loading ----
+
+static size_t section_size(section sec) {
+    switch (sec) {
+        case SEC_EMU: return sizeof(u64);
+        case SEC_CPU: return sizeof(cpu_context);
+        case SEC_SCHD: return sizeof(sched_saved) * SCHED_EVENT_COUNT;
+        case SEC_TIMR: return sizeof(timer_context);
+        case SEC_SERL: return sizeof(serial_context);
+        case SEC_DMA: return sizeof(dma_context);
+        case SEC_LCD: return sizeof(lcd_context);
+        case SEC_PPU: return PPU_STATE_SIZE + sizeof(ppu_saved);
+        case SEC_RAM: return sizeof(ram_context);
+        case SEC_JOYP: return sizeof(joypad_context);
+        case SEC_BOOT: return sizeof(bool);
+        case SEC_CART: return sizeof(cart_saved) + cart_ram_banks() * 0x2000;
+        case SEC_APU: return APU_HEAD + APU_TAIL;
+        default: return 0; // checked by its own code
+    }
+}
+
+static bool check_sched(const sched_saved* p) {
+    for (int i=0; i<SCHED_EVENT_COUNT; i++) {
+        if (p[i].when != SCHED_NEVER && !sched_callback_at(i, p[i].callback)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool check_ppu(const u8* p) {
+    const ppu_saved* extra = (const ppu_saved*)(p + PPU_STATE_SIZE);
+    return extra->fifo_size <= STATE_FIFO_MAX && extra->line_sprites < SPRITE_LINES;
+}
+
+static bool check_cart(const cart_saved* p) {
+    cart_context* cart = cart_get_context();
+    return p->global_checksum == cart->header->global_checksum &&
+        p->checksum == cart->header->checksum &&
+        p->type == cart->header->type &&
+        p->rom_bank + 0x4000 <= cart->rom_size &&
+        (p->ram_bank == 0xFF || (p->ram_bank < 16 && cart->ram_banks[p->ram_bank]));
+}
+
+static bool check_blip(const u8* p, size_t size) {
+    for (int i=0; i<2; i++) {
+        if (size < sizeof(blip_saved)) {
+            return false;
+        }
+        const blip_saved* b = (const blip_saved*)p;
+        size_t len = sizeof(blip_saved) + (size_t)b->used * sizeof(int32_t);
+        if (b->used > BLIP_SIZE + BLIP_MAX_TAPS || len > size) {
+            return false;
+        }
+        p += len;
+        size -= len;
+    }
+    return size == 0;
+}
+
+static void load_ppu(const u8* p) {
+    ppu_context* ppu = ppu_get_context();
+    pipeline_fifo_reset();
+    memcpy(ppu, p, PPU_STATE_SIZE);
+
+    const ppu_saved* extra = (const ppu_saved*)(p + PPU_STATE_SIZE);
+    ppu->line_sprites = extra->has_line_sprites ? &ppu->sprites.lines[extra->line_sprites] : NULL;
+    ppu->pfc.pixel_fifo.head = ppu->pfc.pixel_fifo.tail = NULL;
+    ppu->pfc.pixel_fifo.size = 0;
+    if (ppu->skip_frame) {
+        ppu->pfc.pixel_fifo.size = extra->fifo_size;
+    } else {
+        for (int i=0; i<extra->fifo_size; i++) {
+            pixel_fifo_push(extra->fifo[i]);
+        }
+    }
+}
+
+static void load_cart(const cart_saved* p) {
+    cart_context* cart = cart_get_context();
+    cart->ram_enabled = p->ram_enabled;
+    cart->ram_banking = p->ram_banking;
+    cart->banking_mode = p->banking_mode;
+    cart->rom_bank_value = p->rom_bank_value;
+    cart->ram_bank_value = p->ram_bank_value;
+    cart->need_save = p->need_save;
+    cart->rom_bank_x = cart->rom_data + p->rom_bank;
+    cart->ram_bank = p->ram_bank == 0xFF ? NULL : cart->ram_banks[p->ram_bank];
+
+    const u8* ram = (const u8*)(p + 1);
+    for (int i=0; i<16; i++) {
+        if (cart->ram_banks[i]) {
+            memcpy(cart->ram_banks[i], ram, 0x2000);
+            ram += 0x2000;
+        }
+    }
+}
+
+// Keeps the session's synth flag. Without saved step buffers a
+// synthesising APU starts its output afresh.
+static void load_apu(const u8* p, const u8* blip) {
+    apu_state* apu = apu_get_state();
+    bool synth = apu->synth;
+    memcpy(apu, p, APU_HEAD);
+    memcpy((u8*)apu + APU_TAIL_AT, p + APU_HEAD, APU_TAIL);
+    apu->synth = synth;
+
+    blip_buffer* blips[2] = { &apu->blip_l, &apu->blip_r };
+    for (int i=0; synth && i<2; i++) {
+        if (!blip) {
+            blip_clear(blips[i]);
+            apu->ticks = apu->frame_start = emu_get_context()->ticks;
+            continue;
+        }
+        const blip_saved* b = (const blip_saved*)blip;
+        blips[i]->factor = b->factor;
+        blips[i]->offset = b->offset;
+        blips[i]->integrator = b->integrator;
+        memcpy(blips[i]->buf, b + 1, b->used * sizeof(int32_t));
+        memset(blips[i]->buf + b->used, 0, (BLIP_SIZE + BLIP_MAX_TAPS - b->used) * sizeof(int32_t));
+        blip += sizeof(blip_saved) + b->used * sizeof(int32_t);
+    }
+    apu_state_loaded();
+}
+
+bool state_load(const u8* buf, size_t size) {
+    const state_header* h = (const state_header*)buf;
+    if (size < sizeof(state_header) || h->magic != STATE_MAGIC ||
+        h->version != STATE_VERSION || h->size > size) {
+        return false;
+    }
+
+    const u8* found[SEC_COUNT] = {0};
+    u32 found_size[SEC_COUNT] = {0};
+    size_t at = sizeof(state_header);
+    for (u32 n=0; n<h->sections; n++) {
+        if (at + sizeof(state_section) > h->size) {
+            return false;
+        }
+        const state_section* s = (const state_section*)(buf + at);
+        at += sizeof(state_section);
+        if (at + ALIGN8(s->size) > h->size) {
+            return false;
+        }
+        for (int i=0; i<SEC_COUNT; i++) {
+            if (s->id == section_ids[i]) {
+                found[i] = buf + at;
+                found_size[i] = s->size;
+            }
+        }
+        at += ALIGN8(s->size);
+    }
+
+    for (int i=0; i<SEC_COUNT; i++) {
+        if (i == SEC_BLIP) {
+            if (found[i] && !check_blip(found[i], found_size[i])) {
+                return false;
+            }
+        } else if (!found[i] || found_size[i] != section_size(i)) {
+            return false;
+        }
+    }
+    if (!check_sched((const sched_saved*)found[SEC_SCHD]) || !check_ppu(found[SEC_PPU]) ||
+        !check_cart((const cart_saved*)found[SEC_CART])) {
+        return false;
+    }
+
+    memcpy(&emu_get_context()->ticks, found[SEC_EMU], sizeof(u64));
+    cpu_context* cpu = cpu_get_context();
+    memcpy(cpu, found[SEC_CPU], sizeof(cpu_context));
+    cpu->curr_inst = instruction_by_opcode(cpu->curr_opcode);
+    memcpy(timer_get_context(), found[SEC_TIMR], sizeof(timer_context));
+    memcpy(serial_get_context(), found[SEC_SERL], sizeof(serial_context));
+    memcpy(dma_get_context(), found[SEC_DMA], sizeof(dma_context));
+    memcpy(lcd_get_context(), found[SEC_LCD], sizeof(lcd_context));
+    load_ppu(found[SEC_PPU]);
+    ppu_state_loaded();
+    memcpy(ram_get_context(), found[SEC_RAM], sizeof(ram_context));
+    memcpy(joypad_get_context(), found[SEC_JOYP], sizeof(joypad_context));
+    memcpy(&bootrom_get()->enabled, found[SEC_BOOT], sizeof(bool));
+    load_cart((const cart_saved*)found[SEC_CART]);
+
+    const sched_saved* events = (const sched_saved*)found[SEC_SCHD];
+    sched_init();
+    for (int i=0; i<SCHED_EVENT_COUNT; i++) {
+        if (events[i].when != SCHED_NEVER) {
+            sched_add(i, events[i].when, sched_callback_at(i, events[i].callback));
+        }
+    }
+    load_apu(found[SEC_APU], found[SEC_BLIP]); // after the events, it checks its flush
+    return true;
+}
+
+// ---- files ----
+
+bool state_save_file(const char* path) {
+    u8* buf = malloc(STATE_MAX_SIZE);
+    size_t size = buf ? state_save(buf, STATE_MAX_SIZE) : 0;
+    FILE* fp = size ? fopen(path, "wb") : NULL;
+    bool ok = fp && fwrite(buf, 1, size, fp) == size;
+    if (fp && fclose(fp) != 0) {
+        ok = false;
+    }
+    free(buf);
+    return ok;
+}
+
+bool state_load_file(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    u8* buf = malloc(STATE_MAX_SIZE);
+    size_t size = buf ? fread(buf, 1, STATE_MAX_SIZE, fp) : 0;
+    fclose(fp);
+    bool ok = size && state_load(buf, size);
+    free(buf);
+    return ok;
+}
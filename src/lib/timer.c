@@ -1,48 +1,105 @@
 #include <timer.h>
 #include <interrupts.h>
+#include <scheduler.h>
+#include <emu.h>
 
 static timer_context ctx = {0};
 
+// TIMA counts falling edges of this DIV bit, by TAC clock select.
+static const u8 timer_bits[4] = {9, 3, 5, 7};
+
+#define TIMER_ENABLED (ctx.tac & (1 << 2))
+#define TIMER_PERIOD (2u << timer_bits[ctx.tac & 0b11])
+
+static void timer_schedule();
+
 timer_context* timer_get_context() {
     return &ctx;
 }
 
-void timer_init() {
-    ctx.div = 0xAC00;
+static u64 timer_now() {
+    return emu_get_context()->ticks;
 }
 
-void timer_tick() {
-    u16 prev_div = ctx.div;
-    ctx.div++;
-    bool timer_update = false;
+u16 timer_div() {
+    return timer_now() - ctx.div_start;
+}
 
-    switch(ctx.tac & (0b11)) {
-        case 0b00:
-            timer_update = (prev_div & (1 << 9)) && (!(ctx.div & (1 << 9)));
-            break;
-        case 0b01:
-            timer_update = (prev_div & (1 << 3)) && (!(ctx.div & (1 << 3)));
-            break;
-        case 0b10:
-            timer_update = (prev_div & (1 << 5)) && (!(ctx.div & (1 << 5)));
-            break;
-        case 0b11:
-            timer_update = (prev_div & (1 << 7)) && (!(ctx.div & (1 << 7)));
-            break;
-    }
-    if (timer_update && ctx.tac & (1 << 2)) {
-        ctx.tima++;
-        if (ctx.tima == 0xFF) {
-            ctx.tima = ctx.tma;
-            cpu_request_interrupt(IT_TIMER);
+// First tick after ticks that TIMA counts on.
+static u64 timer_next_edge(u64 ticks) {
+    return ticks + TIMER_PERIOD - ((ticks - ctx.div_start) & (TIMER_PERIOD - 1));
+}
+
+// Brings tima up to ticks. Overflows in between are handled by the
+// scheduled event, so this only ever counts up to 0xFF.
+static void timer_sync(u64 ticks) {
+    if (TIMER_ENABLED && ticks > ctx.tima_ticks) {
+        u64 first = timer_next_edge(ctx.tima_ticks);
+        if (first <= ticks) {
+            ctx.tima += 1 + (ticks - first) / TIMER_PERIOD;
         }
     }
+    ctx.tima_ticks = ticks;
+}
+
+static void timer_increment() {
+    ctx.tima++;
+    if (ctx.tima == 0xFF) {
+        ctx.tima = ctx.tma;
+        cpu_request_interrupt(IT_TIMER);
+    }
+}
+
+static void timer_overflow(u64 ticks) {
+    timer_sync(ticks);
+    ctx.tima = ctx.tma;
+    cpu_request_interrupt(IT_TIMER);
+    timer_schedule();
+}
+
+static void timer_schedule() {
+    if (!TIMER_ENABLED) {
+        sched_cancel(SCHED_TIMER);
+        return;
+    }
+    u32 edges = (u8)(0xFF - ctx.tima);
+    if (!edges) {
+        edges = 0x100; // wraps through 0 first
+    }
+    u64 when = timer_next_edge(ctx.tima_ticks) + (u64)(edges - 1) * TIMER_PERIOD;
+    sched_add(SCHED_TIMER, when, timer_overflow);
+}
+
+// The input TIMA counts edges of: the selected DIV bit, gated by enable.
+static bool timer_signal() {
+    return TIMER_ENABLED && (timer_div() >> timer_bits[ctx.tac & 0b11]) & 1;
+}
+
+void timer_init() {
+    static const sched_callback callbacks[] = { timer_overflow };
+    sched_register(SCHED_TIMER, callbacks, 1);
+    ctx.tima = 0;
+    ctx.tma = 0;
+    ctx.tac = 0;
+    ctx.tima_ticks = timer_now();
+    timer_set_div(0xAC00);
+}
+
+void timer_set_div(u16 div) {
+    ctx.div_start = timer_now() - div;
+    timer_schedule();
 }
 
 void timer_write(u16 address, u8 value) {
+    timer_sync(timer_now());
     switch(address) {
         case 0xFF04: {
-            ctx.div = 0;
+            // Clearing DIV can drop the selected bit, which TIMA sees as
+            // a falling edge.
+            if (timer_signal()) {
+                timer_increment();
+            }
+            ctx.div_start = timer_now();
             break;
         }
         case 0xFF05: {
@@ -54,18 +111,25 @@ void timer_write(u16 address, u8 value) {
             break;
         }
         case 0xFF07: {
+            // Same for disabling the timer or switching to a clear bit.
+            bool before = timer_signal();
             ctx.tac = value;
+            if (before && !timer_signal()) {
+                timer_increment();
+            }
             break;
         }
     }
+    timer_schedule();
 }
 
 u8 timer_read(u16 address) {
     switch(address) {
         case 0xFF04: {
-            return ctx.div >> 8;
+            return timer_div() >> 8;
         }
         case 0xFF05: {
+            timer_sync(timer_now());
             return ctx.tima;
         }
         case 0xFF06: {
@@ -76,4 +140,4 @@ u8 timer_read(u16 address) {
         }
     }
     return 0x0;
-}
\ No newline at end of file
+}
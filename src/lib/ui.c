@@ -5,6 +5,7 @@
 #include <ppu.h>
 #include <joypad.h>
 #include <apu.h>
+#include <palette.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
@@ -22,6 +23,15 @@ SDL_Surface* sdl_debug_screen;
 
 static int scale = 4;
 
+// ARGB frame converted from the indexed framebuffer at present time.
+static u32 present_buffer[160 * 144];
+
+static bool vsync = false;
+
+void ui_set_vsync(bool on) {
+    vsync = on;
+}
+
 void ui_init() {
     printf("SDL INIT\n");
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0) {
@@ -30,7 +40,11 @@ void ui_init() {
     apu_init(48000);
     printf("TTF INIT\n");
     TTF_Init();
+    // Only the main window waits for vsync, the debug window must not
+    // add a second wait per frame.
+    SDL_SetHint(SDL_HINT_RENDER_VSYNC, vsync ? "1" : "0");
     SDL_CreateWindowAndRenderer(SCREEN_WIDTH, SCREEN_HEIGHT, 0, &sdl_window, &sdl_renderer);
+    SDL_SetHint(SDL_HINT_RENDER_VSYNC, "0");
     sdl_screen = SDL_CreateRGBSurface(
         0,
         SCREEN_WIDTH,
@@ -139,24 +153,51 @@ void update_debug_window() {
 }
 
 void ui_update() {
-     SDL_Rect rc;
-    rc.x = rc.y = 0;
-    rc.w = rc.h = 2048;
-
-    u32 *video_buffer = ppu_get_context()->video_buffer;
+    SDL_Rect rc;
+    u64 dirty[DIRTY_WORDS];
+    // Dirty lines first, then the frame: it is always at least as new.
+    bool changed = ppu_take_dirty_lines(dirty);
+    ppu_acquire_frame();
+    if (!changed) {
+        // Same picture as last time, nothing to upload.
+        update_debug_window();
+        return;
+    }
 
+    int first_line = -1;
+    int last_line = 0;
     for (int line_num = 0; line_num < YRES; line_num++) {
+        if (!LINE_DIRTY(dirty, line_num)) {
+            continue;
+        }
+        if (first_line < 0) {
+            first_line = line_num;
+        }
+        last_line = line_num;
+
+        const u32 *line = (const u32 *)ppu_front_buffer() + (line_num * XRES);
+        if (ppu_get_context()->indexed) {
+            u32 *converted = present_buffer + (line_num * XRES);
+            palette_convert((const u8 *)ppu_front_buffer() + (line_num * XRES), converted, XRES);
+            line = converted;
+        }
+
         for (int x = 0; x < XRES; x++) {
             rc.x = x * scale;
             rc.y = line_num * scale;
             rc.w = scale;
             rc.h = scale;
 
-            SDL_FillRect(sdl_screen, &rc, video_buffer[x + (line_num * XRES)]);
+            SDL_FillRect(sdl_screen, &rc, line[x]);
         }
     }
 
-    SDL_UpdateTexture(sdl_texture, NULL, sdl_screen->pixels, sdl_screen->pitch);
+    // Only the rows between the first and last changed line go to the GPU.
+    rc.x = 0;
+    rc.y = first_line * scale;
+    rc.w = sdl_screen->w;
+    rc.h = (last_line - first_line + 1) * scale;
+    SDL_UpdateTexture(sdl_texture, &rc, (u8 *)sdl_screen->pixels + (rc.y * sdl_screen->pitch), sdl_screen->pitch);
     SDL_RenderClear(sdl_renderer);
     SDL_RenderCopy(sdl_renderer, sdl_texture, NULL, NULL);
     SDL_RenderPresent(sdl_renderer);
@@ -173,6 +214,8 @@ void ui_on_key(bool down, u32 key_code) {
         case SDLK_DOWN: joypad_get_state()->down = down; break;
         case SDLK_LEFT: joypad_get_state()->left = down; break;
         case SDLK_RIGHT: joypad_get_state()->right = down; break;
+        case SDLK_F5: emu_get_context()->save_state |= down; break;
+        case SDLK_F8: emu_get_context()->load_state |= down; break;
     }
 }
 
@@ -0,0 +1,127 @@
+#include <wav_capture.h>
+#include <sched.h>
+#include <string.h>
+
+static capture_context ctx = {
+    .writer = WORKER_INIT
+};
+
+capture_context* capture_get_context() {
+    return &ctx;
+}
+
+static void put_u16(u8* p, u16 v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_u32(u8* p, u32 v) {
+    put_u16(p, v & 0xFFFF);
+    put_u16(p + 2, v >> 16);
+}
+
+static void wav_write_header(int sample_rate) {
+    u8 h[44];
+    memcpy(h, "RIFF", 4);
+    put_u32(h + 4, 36);           // patched as data arrives
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_u32(h + 16, 16);          // fmt chunk size
+    put_u16(h + 20, 1);           // PCM
+    put_u16(h + 22, 2);           // channels
+    put_u32(h + 24, sample_rate);
+    put_u32(h + 28, sample_rate * 4);
+    put_u16(h + 32, 4);           // bytes per frame
+    put_u16(h + 34, 16);          // bits per sample
+    memcpy(h + 36, "data", 4);
+    put_u32(h + 40, 0);           // patched as data arrives
+    fwrite(h, 1, sizeof(h), ctx.file);
+}
+
+// Makes everything written so far a complete file.
+static void wav_patch_header() {
+    u8 size[4];
+    u32 data = ctx.data_bytes > 0xFFFFFFFFULL - 36 ? 0xFFFFFFFFU - 36 : (u32)ctx.data_bytes;
+    put_u32(size, data + 36);
+    fseek(ctx.file, 4, SEEK_SET);
+    fwrite(size, 1, 4, ctx.file);
+    put_u32(size, data);
+    fseek(ctx.file, 40, SEEK_SET);
+    fwrite(size, 1, 4, ctx.file);
+    fseek(ctx.file, 0, SEEK_END);
+    fflush(ctx.file);
+}
+
+// Writes out everything queued, in at most two pieces.
+static void wav_drain() {
+    const int16_t* piece[2];
+    u32 count[2];
+    u32 n = frame_ring_peek(&ctx.queue, piece, count);
+    if (!n) {
+        return;
+    }
+
+    fwrite(piece[0], 4, count[0], ctx.file);
+    fwrite(piece[1], 4, count[1], ctx.file);
+    ctx.data_bytes += (u64)n * 4;
+    frame_ring_consume(&ctx.queue, n);
+    wav_patch_header();
+}
+
+static bool wav_below_chunk() {
+    return frame_ring_fill(&ctx.queue) < CAPTURE_CHUNK_FRAMES;
+}
+
+static void* wav_capture_run(void* p) {
+    while (true) {
+        bool running = worker_wait(&ctx.writer, wav_below_chunk);
+        wav_drain();
+        if (!running) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+bool wav_capture_start(const char* path, int sample_rate) {
+    ctx.file = fopen(path, "wb");
+    if (!ctx.file) {
+        return false;
+    }
+    wav_write_header(sample_rate);
+    ctx.data_bytes = 0;
+    frame_ring_init(&ctx.queue, ctx.frames, CAPTURE_QUEUE_FRAMES);
+    worker_start(&ctx.writer, wav_capture_run, "capture");
+    return true;
+}
+
+void wav_capture_stop() {
+    if (!worker_running(&ctx.writer)) {
+        return;
+    }
+    worker_stop(&ctx.writer);
+    fclose(ctx.file);
+    ctx.file = NULL;
+}
+
+bool wav_capture_active() {
+    return worker_running(&ctx.writer);
+}
+
+void wav_capture_write(const int16_t* frames, u32 count) {
+    while (count) {
+        u32 before = frame_ring_fill(&ctx.queue);
+        u32 n = frame_ring_write(&ctx.queue, frames, count);
+        if (!n) {
+            worker_wake(&ctx.writer);
+            sched_yield();
+            continue;
+        }
+        frames += n * 2;
+        count -= n;
+
+        // Wake the writer once per chunk crossed, not per block.
+        if (before < CAPTURE_CHUNK_FRAMES && before + n >= CAPTURE_CHUNK_FRAMES) {
+            worker_wake(&ctx.writer);
+        }
+    }
+}